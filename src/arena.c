@@ -0,0 +1,97 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "safeio.h"
+
+/*
+ * Memory is reserved in chunks aligned to their size, starting with a header.
+ * Objects are only allocated within the first ARENA_CHUNK_SIZE bytes of a
+ * chunk, so masking off the low bits of an object pointer gives its chunk
+ * header. Objects that don't fit in a regular chunk get a chunk of their own.
+ */
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define ARENA_ALIGNMENT 8
+
+typedef struct arena_chunk_t {
+    uint32_t generation;
+    struct arena_chunk_t *prev;
+} arena_chunk_t;
+
+#define CHUNK_HEADER_SIZE ((sizeof(arena_chunk_t) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+struct arena_t {
+    uint32_t generation;
+    arena_chunk_t *last;
+    size_t used;
+    size_t capacity;
+    uint64_t reserved;
+};
+
+arena_t *arena_create(uint32_t generation)
+{
+    arena_t *arena = calloc(1, sizeof(arena_t));
+    CHECK(arena, "could not allocate arena");
+    arena->generation = generation;
+    return arena;
+}
+
+static void arena_add_chunk(arena_t *arena, size_t size)
+{
+    void *mem;
+    CHECK(posix_memalign(&mem, ARENA_CHUNK_SIZE, size) == 0,
+          "could not allocate arena chunk of %zu bytes", size);
+
+    arena_chunk_t *chunk = mem;
+    chunk->generation = arena->generation;
+    chunk->prev = arena->last;
+
+    arena->last = chunk;
+    arena->used = CHUNK_HEADER_SIZE;
+    arena->capacity = size;
+    arena->reserved += size;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    if (arena->last == NULL || arena->used + size > arena->capacity) {
+        if (CHUNK_HEADER_SIZE + size > ARENA_CHUNK_SIZE) {
+            /* dedicated chunk, which is full right away */
+            arena_add_chunk(arena, CHUNK_HEADER_SIZE + size);
+            arena->used = arena->capacity;
+            return (uint8_t *)arena->last + CHUNK_HEADER_SIZE;
+        }
+        arena_add_chunk(arena, ARENA_CHUNK_SIZE);
+    }
+
+    void *res = (uint8_t *)arena->last + arena->used;
+    arena->used += size;
+    return res;
+}
+
+uint32_t arena_generation_of(const void *ptr)
+{
+    const arena_chunk_t *chunk =
+        (const arena_chunk_t *)((uintptr_t)ptr & ~((uintptr_t)ARENA_CHUNK_SIZE - 1));
+    return chunk->generation;
+}
+
+uint64_t arena_reserved_bytes(const arena_t *arena)
+{
+    return arena->reserved;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    while (arena->last) {
+        arena_chunk_t *chunk = arena->last;
+        arena->last = chunk->prev;
+        free(chunk);
+    }
+    free(arena);
+}
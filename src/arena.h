@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Bump allocator for objects that all die at the same time.
+ *
+ * Every arena is tagged with a generation number, which can be recovered from
+ * any pointer allocated from it. There is no way to free individual objects,
+ * destroying the arena releases everything at once.
+ *
+ * Not thread-safe, use one arena per thread.
+ */
+
+typedef struct arena_t arena_t;
+
+arena_t *arena_create(uint32_t generation);
+
+/* malloc; never returns NULL */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/* Generation of the arena that ptr was allocated from. */
+uint32_t arena_generation_of(const void *ptr);
+
+/* Total number of bytes reserved by the arena. */
+uint64_t arena_reserved_bytes(const arena_t *arena);
+
+/* Destroy arena, freeing all memory. */
+void arena_destroy(arena_t *arena);
@@ -0,0 +1,245 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <Judy.h>
+
+#include "fns_generated.h"
+#include "fns_imported.h"
+#include "hyperloglog.h"
+#include "utils.h"
+#include "safeio.h"
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC "TRCKCKP1"
+#define END_OF_RESULTS UINT64_MAX
+
+void checkpoint_info_free(checkpoint_info_t *info)
+{
+    for (uint64_t i = 0; i < info->num_traildbs; i++)
+        free(info->traildb_paths[i]);
+    free(info->traildb_paths);
+    info->traildb_paths = NULL;
+    info->num_traildbs = 0;
+}
+
+struct checkpoint_writer_t {
+    char *path;
+    char *tmp_path;
+    FILE *f;
+    uint8_t index[MAXLINELEN];
+};
+
+static void write_u64(checkpoint_writer_t *w, uint64_t v)
+{
+    SAFE_WRITE(&v, sizeof(v), w->tmp_path, w->f);
+}
+
+static void write_bytes(checkpoint_writer_t *w, const void *buf, uint64_t len)
+{
+    write_u64(w, len);
+    if (len)
+        SAFE_WRITE(buf, len, w->tmp_path, w->f);
+}
+
+checkpoint_writer_t *checkpoint_write_start(const char *path,
+                                            const checkpoint_info_t *info)
+{
+    checkpoint_writer_t *w = calloc(1, sizeof(checkpoint_writer_t));
+    CHECK(w, "could not allocate checkpoint writer");
+
+    w->path = strdup(path);
+    w->tmp_path = malloc(strlen(path) + 5);
+    CHECK(w->path && w->tmp_path, "could not allocate checkpoint writer");
+    sprintf(w->tmp_path, "%s.tmp", path);
+
+    if (!(w->f = fopen(w->tmp_path, "w")))
+        DIE("Could not create checkpoint %s\n", w->tmp_path);
+
+    SAFE_WRITE(CHECKPOINT_MAGIC, 8, w->tmp_path, w->f);
+    write_u64(w, info->state_size);
+    write_u64(w, info->num_results);
+    write_u64(w, info->groupby_fingerprint);
+    write_u64(w, info->min_ts);
+    write_u64(w, info->num_traildbs);
+    for (uint64_t i = 0; i < info->num_traildbs; i++)
+        write_bytes(w, info->traildb_paths[i], strlen(info->traildb_paths[i]));
+    return w;
+}
+
+void checkpoint_write_result(checkpoint_writer_t *w, uint64_t index)
+{
+    write_u64(w, index);
+}
+
+void checkpoint_save_int(void *arg, char *name, int64_t value)
+{
+    checkpoint_writer_t *w = (checkpoint_writer_t *)arg;
+    write_bytes(w, name, strlen(name));
+    write_u64(w, (uint64_t)value);
+}
+
+void checkpoint_save_set(void *arg, char *name, set_t *value)
+{
+    checkpoint_writer_t *w = (checkpoint_writer_t *)arg;
+    write_bytes(w, name, strlen(name));
+
+    uint8_t *index = w->index;
+    Word_t *pv;
+
+    uint64_t count = 0;
+    index[0] = '\0';
+    JSLF(pv, *value, index);
+    while (pv) {
+        count++;
+        JSLN(pv, *value, index);
+    }
+    write_u64(w, count);
+
+    index[0] = '\0';
+    JSLF(pv, *value, index);
+    while (pv) {
+        write_bytes(w, index, strlen((char *)index));
+        write_u64(w, *pv);
+        JSLN(pv, *value, index);
+    }
+}
+
+void checkpoint_save_hll(void *arg, char *name, hyperloglog_t *value)
+{
+    checkpoint_writer_t *w = (checkpoint_writer_t *)arg;
+    write_bytes(w, name, strlen(name));
+    if (value) {
+        write_u64(w, value->p);
+        SAFE_WRITE(value->M, value->m, w->tmp_path, w->f);
+    } else {
+        write_u64(w, 0);
+    }
+}
+
+void checkpoint_write_finish(checkpoint_writer_t *w)
+{
+    write_u64(w, END_OF_RESULTS);
+    SAFE_FLUSH(w->f, w->tmp_path);
+    if (fsync(fileno(w->f)))
+        DIE("Syncing %s failed\n", w->tmp_path);
+    SAFE_CLOSE(w->f, w->tmp_path);
+
+    if (rename(w->tmp_path, w->path))
+        DIE("Renaming %s to %s failed\n", w->tmp_path, w->path);
+
+    free(w->path);
+    free(w->tmp_path);
+    free(w);
+}
+
+struct checkpoint_reader_t {
+    const char *path;
+    FILE *f;
+    uint8_t buf[MAXLINELEN];
+};
+
+static uint64_t read_u64(checkpoint_reader_t *r)
+{
+    uint64_t v;
+    SAFE_FREAD(r->f, r->path, &v, sizeof(v));
+    return v;
+}
+
+/* Read length-prefixed bytes into r->buf, zero-terminated. */
+static uint64_t read_bytes(checkpoint_reader_t *r)
+{
+    uint64_t len = read_u64(r);
+    CHECK(len < MAXLINELEN, "Checkpoint %s is corrupted", r->path);
+    if (len)
+        SAFE_FREAD(r->f, r->path, r->buf, len);
+    r->buf[len] = 0;
+    return len;
+}
+
+static void read_name(checkpoint_reader_t *r, const char *name)
+{
+    read_bytes(r);
+    CHECK(strcmp((char *)r->buf, name) == 0,
+          "Checkpoint %s has result %s where %s is expected, was it created by a different program?",
+          r->path, r->buf, name);
+}
+
+checkpoint_reader_t *checkpoint_read_start(const char *path, checkpoint_info_t *info)
+{
+    checkpoint_reader_t *r = malloc(sizeof(checkpoint_reader_t));
+    CHECK(r, "could not allocate checkpoint reader");
+    r->path = path;
+
+    if (!(r->f = fopen(path, "r")))
+        DIE("Could not open checkpoint %s\n", path);
+
+    char magic[8];
+    SAFE_FREAD(r->f, path, magic, 8);
+    CHECK(memcmp(magic, CHECKPOINT_MAGIC, 8) == 0, "%s is not a checkpoint", path);
+
+    info->state_size = read_u64(r);
+    info->num_results = read_u64(r);
+    info->groupby_fingerprint = read_u64(r);
+    info->min_ts = read_u64(r);
+    info->num_traildbs = read_u64(r);
+    info->traildb_paths = calloc(info->num_traildbs, sizeof(char *));
+    CHECK(info->num_traildbs == 0 || info->traildb_paths,
+          "could not allocate checkpoint paths");
+    for (uint64_t i = 0; i < info->num_traildbs; i++) {
+        read_bytes(r);
+        info->traildb_paths[i] = strdup((char *)r->buf);
+    }
+    return r;
+}
+
+bool checkpoint_read_result(checkpoint_reader_t *r, uint64_t *index)
+{
+    *index = read_u64(r);
+    return *index != END_OF_RESULTS;
+}
+
+int64_t checkpoint_load_int(void *arg, char *name)
+{
+    checkpoint_reader_t *r = (checkpoint_reader_t *)arg;
+    read_name(r, name);
+    return (int64_t)read_u64(r);
+}
+
+void checkpoint_load_set(void *arg, char *name, set_t *value)
+{
+    checkpoint_reader_t *r = (checkpoint_reader_t *)arg;
+    read_name(r, name);
+
+    uint64_t count = read_u64(r);
+    for (uint64_t i = 0; i < count; i++) {
+        read_bytes(r);
+        Word_t *pv;
+        JSLI(pv, *value, r->buf);
+        CHECK(pv, "could not insert into set");
+        *pv += read_u64(r);
+    }
+}
+
+hyperloglog_t *checkpoint_load_hll(void *arg, char *name)
+{
+    checkpoint_reader_t *r = (checkpoint_reader_t *)arg;
+    read_name(r, name);
+
+    uint64_t p = read_u64(r);
+    if (p == 0)
+        return NULL;
+
+    hyperloglog_t *hll = hll_init(p);
+    SAFE_FREAD(r->f, r->path, hll->M, hll->m);
+    return hll;
+}
+
+void checkpoint_read_finish(checkpoint_reader_t *r)
+{
+    fclose(r->f);
+    free(r);
+}
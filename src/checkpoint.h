@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <Judy.h>
+
+#include "fns_generated.h"
+
+/*
+ * Checkpoint of a multi-TrailDB run, taken after a TrailDB has been fully
+ * processed and its states merged.
+ *
+ * A checkpoint is a pair of files: path contains the list of processed
+ * TrailDBs and accumulated (not yet finalized) results, and states are kept
+ * in a state file (see state_file.h), tagged with the number of processed
+ * TrailDBs. Both files are replaced atomically; states are written first,
+ * so a crash in between is detected by a tag mismatch.
+ *
+ * Results are opaque outside generated code, so they are written and read
+ * with match_save_result/match_load_result and the callbacks below.
+ */
+
+typedef struct checkpoint_info_t {
+    uint64_t state_size;      /* sizeof(state_t), to catch program changes */
+    uint64_t num_results;
+    uint64_t groupby_fingerprint;
+    uint64_t min_ts;
+    uint64_t num_traildbs;
+    char **traildb_paths;     /* processed TrailDBs */
+} checkpoint_info_t;
+
+void checkpoint_info_free(checkpoint_info_t *info);
+
+/************************ writing ********************************************/
+
+typedef struct checkpoint_writer_t checkpoint_writer_t;
+
+checkpoint_writer_t *checkpoint_write_start(const char *path,
+                                            const checkpoint_info_t *info);
+
+/*
+ * Start writing result with given index, then call match_save_result with
+ * checkpoint_save_* callbacks and the writer as arg.
+ */
+void checkpoint_write_result(checkpoint_writer_t *w, uint64_t index);
+
+void checkpoint_save_int(void *w, char *name, int64_t value);
+void checkpoint_save_set(void *w, char *name, set_t *value);
+void checkpoint_save_hll(void *w, char *name, hyperloglog_t *value);
+
+/* Sync and atomically replace path. */
+void checkpoint_write_finish(checkpoint_writer_t *w);
+
+/************************ reading ********************************************/
+
+typedef struct checkpoint_reader_t checkpoint_reader_t;
+
+checkpoint_reader_t *checkpoint_read_start(const char *path, checkpoint_info_t *info);
+
+/*
+ * Advance to the next result. If there is one, returns true and sets index,
+ * then match_load_result has to be called with checkpoint_load_* callbacks
+ * and the reader as arg.
+ */
+bool checkpoint_read_result(checkpoint_reader_t *r, uint64_t *index);
+
+int64_t checkpoint_load_int(void *r, char *name);
+void checkpoint_load_set(void *r, char *name, set_t *value);
+hyperloglog_t *checkpoint_load_hll(void *r, char *name);
+
+void checkpoint_read_finish(checkpoint_reader_t *r);
@@ -8,6 +8,129 @@
 
 #include "match_internal.h"
 #include "safeio.h"
+#include "db.h"
+
+/* Initial arena size, in events */
+#define CTX_ARENA_EVENTS 4096
+
+/*
+ * Exact duplicates of the previous event are skipped. Comparing timestamps
+ * first is just a shortcut to avoid calling memcmp in most cases.
+ */
+static inline bool same_event(const tdb_event *a, const tdb_event *b, size_t size)
+{
+    return a->timestamp == b->timestamp && memcmp(a, b, size) == 0;
+}
+
+/*
+ * Check if event contains any of the prefilter items (see db_add_prefilter).
+ * Events are not projected yet at this point.
+ */
+static inline bool passes_prefilter(const db_t *db, const tdb_event *e)
+{
+    if (!db->has_prefilter)
+        return true;
+
+    for (int i = 0; i < db->num_prefilter_items; i++) {
+        tdb_item item = db->prefilter_items[i];
+        if (e->items[tdb_item_field(item) - 1] == item)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * An event of a trail read in place is kept if it's not a duplicate of the
+ * previous event, and passes the prefilter. Duplicates are found before
+ * filtering, as identical events with something in between are not
+ * duplicates.
+ */
+static inline bool keep_in_place(const ctx_t *ctx, int64_t i)
+{
+    size_t size = ctx->event_size;
+    const tdb_event *e = (const tdb_event *)&ctx->buf[i * size];
+
+    if (i > 0 && same_event((const tdb_event *)&ctx->buf[(i - 1) * size], e, size))
+        return false;
+    return passes_prefilter(ctx->db, e);
+}
+
+/*
+ * Drop duplicate events and events that don't pass the prefilter from a
+ * trail that was read in place, copying the rest to the arena if anything
+ * is dropped at all.
+ */
+static void ctx_dedup_in_place(ctx_t *ctx)
+{
+    size_t size = ctx->event_size;
+    int64_t i = 0;
+
+    while (i < ctx->num_events && keep_in_place(ctx, i))
+        i++;
+
+    if (i >= ctx->num_events)
+        return;
+
+    if (ctx->arena_size < ctx->num_events * size) {
+        free(ctx->arena);
+        ctx->arena_size = ctx->num_events * size;
+        ctx->arena = malloc(ctx->arena_size);
+        CHECK(ctx->arena, "could not grow ctx arena");
+    }
+
+    memcpy(ctx->arena, ctx->buf, i * size);
+
+    int64_t num_unique = i;
+    for (i++; i < ctx->num_events; i++) {
+        if (keep_in_place(ctx, i))
+            memcpy(&ctx->arena[num_unique++ * size], &ctx->buf[i * size], size);
+    }
+
+    ctx->buf = ctx->arena;
+    ctx->num_events = num_unique;
+}
+
+/*
+ * Replace events with events only containing projected fields (see
+ * db_set_projection). Under a foreach, trails are replayed many times, so
+ * this makes every replay touch less memory. Done after deduplication, as
+ * events that only differ in fields that aren't projected are not
+ * duplicates.
+ */
+static void ctx_project(ctx_t *ctx)
+{
+    const db_t *db = ctx->db;
+    size_t size = ctx->event_size;
+    size_t psize = sizeof(tdb_event) + db->num_slots * sizeof(tdb_item);
+
+    if (ctx->buf != ctx->arena && ctx->arena_size < ctx->num_events * psize) {
+        free(ctx->arena);
+        ctx->arena_size = ctx->num_events * psize;
+        ctx->arena = malloc(ctx->arena_size);
+        CHECK(ctx->arena, "could not grow ctx arena");
+    }
+
+    /*
+     * Projected events are smaller, so when projecting within the arena an
+     * event is never overwritten before it's read.
+     */
+    tdb_item items[db->num_slots];
+    for (int64_t i = 0; i < ctx->num_events; i++) {
+        const tdb_event *e = (const tdb_event *)&ctx->buf[i * size];
+        tdb_event *out = (tdb_event *)&ctx->arena[i * psize];
+        uint64_t timestamp = e->timestamp;
+
+        for (int k = 0; k < db->num_slots; k++)
+            items[k] = e->items[db->slot_to_field[k + 1] - 1];
+
+        out->timestamp = timestamp;
+        out->num_items = db->num_slots;
+        memcpy((tdb_item *)out->items, items, sizeof(items));
+    }
+
+    ctx->buf = ctx->arena;
+    ctx->event_size = psize;
+}
 
 /* call once after opening the db */
 void ctx_init(ctx_t *ctx, db_t *db) {
@@ -17,22 +140,31 @@ void ctx_init(ctx_t *ctx, db_t *db) {
     if (db->filter)
         tdb_cursor_set_event_filter(ctx->cursor, db->filter);
 
-    ctx->event_size = tdb_num_fields(db->db) + 1;
+    ctx->event_size = sizeof(tdb_event) + (tdb_num_fields(db->db) - 1) * sizeof(tdb_item);
     ctx->num_events = 0;
     ctx->cookie = 0;
     ctx->db = db;
     ctx->position = 0;
     ctx->ts_window_end = 0;
     ctx->ts_window_start = 0;
+    ctx->streaming = false;
 
-    ctx->buf = 0;
-    ctx->buf_size = 0;
+    ctx->arena_size = CTX_ARENA_EVENTS * ctx->event_size;
+    ctx->arena = malloc(ctx->arena_size);
+    CHECK(ctx->arena, "could not allocate ctx arena");
+    ctx->buf = ctx->arena;
 
     memset(&ctx->perf_stats, 0, sizeof(ctx->perf_stats));
 }
 
+void ctx_set_streaming(ctx_t *ctx, bool streaming) {
+    CHECK(!streaming || ctx->db->num_slots == 0,
+          "streaming is not supported with field projection");
+    ctx->streaming = streaming;
+}
+
 void ctx_free(ctx_t *ctx) {
-    free(ctx->buf);
+    free(ctx->arena);
     tdb_cursor_free(ctx->cursor);
 }
 
@@ -48,46 +180,135 @@ void ctx_read_trail(ctx_t *ctx, uint64_t trail_id, __uint128_t cookie, uint64_t
     tdb_error res = tdb_get_trail(ctx->cursor, trail_id);
     CHECK(res == 0, "could not get trail %" PRIu64, trail_id);
 
-    size_t offset = 0;
-
     ctx->num_events = 0;
+    ctx->buf = ctx->arena;
+
+    if (ctx->streaming) {
+        /*
+         * Only decode up to the first event within the window that passes
+         * the prefilter. That can't be a duplicate of anything before it:
+         * it would have been filtered out like the event it duplicates.
+         */
+        const tdb_event *e;
+        while ((e = tdb_cursor_next(ctx->cursor))) {
+            if (ctx->ts_window_end && e->timestamp >= ctx->ts_window_end) {
+                e = NULL;
+                break;
+            }
+            if ((!ctx->ts_window_start || e->timestamp >= ctx->ts_window_start) &&
+                passes_prefilter(ctx->db, e))
+                break;
+        }
+        if (e)
+            ctx->event_size = sizeof(tdb_event) + e->num_items * sizeof(tdb_item);
 
-    const tdb_event *e;
-    while ((e = tdb_cursor_next(ctx->cursor))){
-        uint64_t size = sizeof(tdb_event) + e->num_items * sizeof(tdb_item);
-        ctx->event_size = size;
+        ctx->position = 0;
+        ctx->current_event = (tdb_event *)e;
+        return;
+    }
 
+    const tdb_event *e = tdb_cursor_next(ctx->cursor);
+    if (!e)
+        return;
+
+    uint64_t size = sizeof(tdb_event) + e->num_items * sizeof(tdb_item);
+    ctx->event_size = size;
+
+    /*
+     * If the cursor didn't fill up its buffer, the whole trail has been
+     * decoded in one batch, and events already sit in memory back-to-back,
+     * just like we'd copy them. So use them in place; they stay valid until
+     * the next tdb_get_trail() on this cursor.
+     */
+    uint64_t batch_events = ctx->cursor->num_events_left + 1;
+    if (batch_events < ctx->db->cursor_buffer_size) {
+        const uint8_t *p = (const uint8_t *)e;
+
+        if (ctx->ts_window_start)
+            while (batch_events > 0 &&
+                   ((const tdb_event *)p)->timestamp < ctx->ts_window_start) {
+                p += size;
+                batch_events--;
+            }
+
+        ctx->buf = p;
+
+        if (ctx->ts_window_end)
+            while (ctx->num_events < batch_events &&
+                   ((const tdb_event *)p)->timestamp < ctx->ts_window_end) {
+                p += size;
+                ctx->num_events++;
+            }
+        else
+            ctx->num_events = batch_events;
+
+        ctx_dedup_in_place(ctx);
+        if (ctx->db->num_slots && ctx->num_events)
+            ctx_project(ctx);
+        return;
+    }
+
+    /*
+     * Trail spans multiple batches: copy unique events to the arena. An
+     * event that doesn't pass the prefilter is copied too, to compare the
+     * next event against, and then overwritten by it.
+     */
+    size_t offset = 0;
+    int64_t prev_offset = -1;
+
+    for (; e; e = tdb_cursor_next(ctx->cursor)) {
         if (ctx->ts_window_start && e->timestamp < ctx->ts_window_start)
             continue;
 
         if (ctx->ts_window_end && e->timestamp >= ctx->ts_window_end)
             break;
 
-        if (ctx->buf_size == 0) {
-            ctx->buf_size = 10 * size;
-            ctx->buf = malloc(ctx->buf_size);
-        }
+        if (prev_offset >= 0 && same_event((tdb_event *)&ctx->arena[prev_offset], e, size))
+            continue;
 
-        if (offset + size > ctx->buf_size) {
-            ctx->buf_size = ctx->buf_size * 2;
-            ctx->buf = realloc(ctx->buf, ctx->buf_size);
+        if (offset + size > ctx->arena_size) {
+            ctx->arena_size = ctx->arena_size * 2;
+            ctx->arena = realloc(ctx->arena, ctx->arena_size);
+            CHECK(ctx->arena, "could not grow ctx arena");
         }
 
-        memcpy(&ctx->buf[offset], e, size);
+        memcpy(&ctx->arena[offset], e, size);
+        prev_offset = offset;
+
+        if (!passes_prefilter(ctx->db, e))
+            continue;
 
         offset += size;
         ctx->num_events += 1;
     }
+    ctx->buf = ctx->arena;
+
+    if (ctx->db->num_slots && ctx->num_events)
+        ctx_project(ctx);
 }
 
 
 void ctx_reset_position(ctx_t *ctx) {
+    if (ctx->streaming) {
+        CHECK(ctx->position == 0, "can't rewind a streamed trail");
+        ctx->stats = 0;
+        return;
+    }
+
     ctx->position = 0;
     ctx->current_event = (tdb_event *)&ctx->buf[ctx->position * ctx->event_size];
     if (ctx->num_events == 0) ctx->current_event = NULL;
     ctx->stats = 0;
 }
 
+bool ctx_trail_is_empty(ctx_t *ctx)
+{
+    if (ctx->streaming)
+        return ctx->position == 0 && ctx->current_event == NULL;
+    else
+        return ctx->num_events == 0;
+}
+
 bool ctx_end_of_trail(ctx_t *ctx)
 {
     return ctx->current_event == NULL;
@@ -103,36 +324,62 @@ void ctx_update_stats(ctx_t *ctx, stats_flag flag)
     ctx->stats |= flag;
 }
 
-void ctx_advance(ctx_t * ctx)
+/*
+ * Pull next non-duplicate event that passes the prefilter from the cursor.
+ * Events are compared to the previous event from the cursor, even if it was
+ * filtered out. When the cursor is about to decode its next batch, the
+ * previous event gets overwritten, so it is saved to the arena first to
+ * compare against.
+ */
+static void ctx_stream_next(ctx_t *ctx)
 {
-    if (ctx->num_events == 0)
-        ctx->current_event = NULL;
+    const tdb_event *prev = ctx->current_event;
 
+    while (prev) {
+        if (ctx->cursor->num_events_left == 0 && (const uint8_t *)prev != ctx->arena) {
+            memcpy(ctx->arena, prev, ctx->event_size);
+            prev = (const tdb_event *)ctx->arena;
+        }
 
-    while (ctx->position < ctx->num_events) {
-        tdb_event *prev =(tdb_event *)&ctx->buf[ctx->position * ctx->event_size];
+        const tdb_event *next = tdb_cursor_next(ctx->cursor);
 
-        ctx->position++;
+        if (!next || (ctx->ts_window_end && next->timestamp >= ctx->ts_window_end))
+            break;
 
-        if (ctx->position < ctx->num_events) {
-            tdb_event *next = (tdb_event *)&ctx->buf[ctx->position * ctx->event_size];
+        ctx->position++;
 
-            /*
-             * Simply a shortcut to avoid calling libc memcmp in most cases.
-             * Could be replaced with better inline memcmp.
-             */
-            if (prev->timestamp == next->timestamp)
-                if(memcmp(prev, next, sizeof(tdb_event) + sizeof(tdb_item) * prev->num_items) == 0)
-                    continue;
+        if (same_event(prev, next, ctx->event_size))
+            continue;
 
-            ctx->current_event = next;
-            return;
+        if (!passes_prefilter(ctx->db, next)) {
+            prev = next;
+            continue;
         }
+
+        ctx->current_event = (tdb_event *)next;
+        return;
     }
 
     ctx->current_event = NULL;
 }
 
+void ctx_advance(ctx_t * ctx)
+{
+    if (ctx->streaming) {
+        ctx_stream_next(ctx);
+        return;
+    }
+
+    /* duplicates were already dropped by ctx_read_trail() */
+    if (ctx->position + 1 < ctx->num_events) {
+        ctx->position++;
+        ctx->current_event = (tdb_event *)&ctx->buf[ctx->position * ctx->event_size];
+    } else {
+        ctx->position = ctx->num_events;
+        ctx->current_event = NULL;
+    }
+}
+
 int64_t ctx_get_position(ctx_t *ctx)
 {
     return ctx->position;
@@ -161,7 +408,8 @@ const char *ctx_get_item_value(ctx_t *ctx, item_t item, int keyid, int *len)
 
 
     uint64_t value_length;
-    const char *val = tdb_get_value(ctx->db->db, keyid, valueid, &value_length);
+    const char *val = tdb_get_value(ctx->db->db, db_get_item_field(ctx->db, keyid),
+                                    valueid, &value_length);
     *len = value_length;
     return val;
 }
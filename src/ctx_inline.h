@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <traildb.h>
+#include <Judy.h>
+
+#include "match_internal.h"
+
+/*
+ * Inline versions of the ctx_ and item_ functions that generated code calls
+ * for every event (see fns_imported.h). bin/trck includes this header into
+ * out_traildb.c, which is compiled separately from ctx.c, so otherwise each
+ * of them is a real function call.
+ *
+ * They must behave exactly like their counterparts in ctx.c, except that
+ * item_get_value_id doesn't check key bounds. Debug builds keep using the
+ * checked functions from ctx.c.
+ */
+#if !DEBUG
+
+static inline item_t ctx_get_item_inline(ctx_t *ctx)
+{
+    return ctx->current_event;
+}
+
+static inline bool ctx_end_of_trail_inline(ctx_t *ctx)
+{
+    return ctx->current_event == NULL;
+}
+
+static inline void ctx_advance_inline(ctx_t *ctx)
+{
+    /* streamed trails pull events from the cursor, leave that to ctx.c */
+    if (ctx->streaming) {
+        ctx_advance(ctx);
+        return;
+    }
+
+    if (ctx->position + 1 < ctx->num_events) {
+        ctx->position++;
+        ctx->current_event = (tdb_event *)&ctx->buf[ctx->position * ctx->event_size];
+    } else {
+        ctx->position = ctx->num_events;
+        ctx->current_event = NULL;
+    }
+}
+
+static inline timestamp_t item_get_timestamp_inline(item_t item)
+{
+    return ((const tdb_event *)item)->timestamp;
+}
+
+static inline int item_get_value_id_inline(item_t item, int keyid)
+{
+    /* non-existent keys default to 0 */
+    if (keyid == -1)
+        return 0;
+
+    return tdb_item_val(((const tdb_event *)item)->items[keyid-1]);
+}
+
+static inline bool item_is_empty_inline(item_t item)
+{
+    return ((const tdb_event *)item)->num_items == 0;
+}
+
+#define ctx_get_item(ctx) ctx_get_item_inline(ctx)
+#define ctx_end_of_trail(ctx) ctx_end_of_trail_inline(ctx)
+#define ctx_advance(ctx) ctx_advance_inline(ctx)
+#define item_get_timestamp(item) item_get_timestamp_inline(item)
+#define item_get_value_id(item, keyid) item_get_value_id_inline(item, keyid)
+#define item_is_empty(item) item_is_empty_inline(item)
+
+#endif
@@ -12,6 +12,11 @@
 
 #define TIMESTAMP_FIELD_ID 10000
 
+#define CURSOR_EVENT_BUFFER_SIZE 100000
+
+/* 2MB per table at most */
+#define DISPATCH_TABLE_MAX_SIZE (1 << 20)
+
 
 void db_open(db_t *db, const char *traildb_path, const char *filter)
 {
@@ -19,7 +24,8 @@ void db_open(db_t *db, const char *traildb_path, const char *filter)
     CHECK(t != NULL, "failed to create db, out of memory?");
     db->db = t;
     tdb_error res = tdb_open(db->db, traildb_path);
-    tdb_set_opt(db->db, TDB_OPT_CURSOR_EVENT_BUFFER_SIZE, opt_val(100000));
+    tdb_set_opt(db->db, TDB_OPT_CURSOR_EVENT_BUFFER_SIZE, opt_val(CURSOR_EVENT_BUFFER_SIZE));
+    db->cursor_buffer_size = CURSOR_EVENT_BUFFER_SIZE;
 
     CHECK(res == 0, "failed to open traildb %s, error code %d", traildb_path, res);
     memset(&db->id_lookup_table[0], 0, sizeof(db->id_lookup_table));
@@ -30,6 +36,14 @@ void db_open(db_t *db, const char *traildb_path, const char *filter)
     if (filter && strlen(filter) > 0)
         compiled_filter = traildb_compile_filter(db->db, filter, strlen(filter));
     db->filter = compiled_filter;
+
+    db->num_slots = 0;
+    db->field_to_slot = NULL;
+    db->slot_to_field = NULL;
+
+    db->has_prefilter = false;
+    db->num_prefilter_items = 0;
+    db->prefilter_items = NULL;
 }
 
 void db_close(db_t *db)
@@ -41,6 +55,79 @@ void db_close(db_t *db)
             JHSFA(rc, db->id_lookup_table[i]);
     tdb_close(db->db);
     free(db->filter);
+    free(db->field_to_slot);
+    free(db->slot_to_field);
+    free(db->prefilter_items);
+}
+
+/*
+ * Only keep events where at least one of the given fields has the
+ * corresponding value, in addition to the user filter. Unknown fields and
+ * values never match. Unlike the user filter, this is applied by contexts
+ * after duplicate events are dropped, so that it doesn't make identical
+ * events separated by a filtered out event adjacent. Must be called before
+ * any contexts are created.
+ */
+void db_add_prefilter(db_t *db, const char **fields, const char **values, int num_terms)
+{
+    db->prefilter_items = calloc(num_terms + 1, sizeof(tdb_item));
+    CHECK(db->prefilter_items, "could not allocate prefilter");
+
+    for (int i = 0; i < num_terms; i++) {
+        tdb_field field_id;
+        if (tdb_get_field(db->db, fields[i], &field_id))
+            continue;
+
+        tdb_item item = tdb_get_item(db->db, field_id, values[i], strlen(values[i]));
+        if (item)
+            db->prefilter_items[db->num_prefilter_items++] = item;
+    }
+    db->has_prefilter = true;
+}
+
+/*
+ * Only keep given fields in events read by contexts on this db. Does nothing
+ * unless that at least halves the event size, or if none of the fields are
+ * present in the db. Must be called before any ids are resolved.
+ */
+void db_set_projection(db_t *db, const char **fields, int num_fields)
+{
+    uint64_t num_items = tdb_num_fields(db->db) - 1;
+    int field_ids[num_fields + 1];
+    int num_slots = 0;
+
+    for (int i = 0; i < num_fields; i++) {
+        tdb_field field;
+        if (tdb_get_field(db->db, fields[i], &field) == 0 && field > 0)
+            field_ids[num_slots++] = field;
+    }
+
+    if (num_slots == 0 || num_slots > num_items / 2)
+        return;
+
+    db->field_to_slot = calloc(num_items + 1, sizeof(int));
+    db->slot_to_field = calloc(num_slots + 1, sizeof(int));
+    CHECK(db->field_to_slot && db->slot_to_field, "could not allocate projection");
+
+    for (int i = 0; i < num_slots; i++) {
+        db->field_to_slot[field_ids[i]] = i + 1;
+        db->slot_to_field[i + 1] = field_ids[i];
+    }
+    db->num_slots = num_slots;
+}
+
+int db_get_item_key(const db_t *db, int field_id)
+{
+    if (db->num_slots == 0 || field_id == -1)
+        return field_id;
+    return db->field_to_slot[field_id] ? db->field_to_slot[field_id] : -1;
+}
+
+int db_get_item_field(const db_t *db, int key)
+{
+    if (db->num_slots == 0 || key == -1)
+        return key;
+    return db->slot_to_field[key];
 }
 
 /*
@@ -59,6 +146,11 @@ int db_get_key_id(const char* key, db_t *db)
 }
 
 
+/*
+ * Lookup tables are built lazily, which is not thread-safe. When a db_t is
+ * shared between threads, all tables the program needs must be built before
+ * matching starts (see prepare_db() in match_traildb.c).
+ */
 Pvoid_t db_get_lookup_table(db_t *db, int field_id)
 {
     CHECK(field_id < sizeof(db->id_lookup_table) / sizeof(db->id_lookup_table[0]),
@@ -83,6 +175,37 @@ Pvoid_t db_get_lookup_table(db_t *db, int field_id)
     return db->id_lookup_table[field_id];
 }
 
+/*
+ * Build a table mapping value ids of a field to the first of `value_ids`
+ * they are equal to, or to `num_values` if none. Returns NULL if the field
+ * doesn't exist or its lexicon is too large to make a table worthwhile.
+ */
+uint16_t *db_get_dispatch_table(db_t *db, int field_id, const int *value_ids,
+                                int num_values, uint64_t *size)
+{
+    *size = 0;
+    if (field_id < 0 || field_id == TIMESTAMP_FIELD_ID)
+        return NULL;
+
+    uint64_t lexicon_size = tdb_lexicon_size(db->db, field_id);
+    if (lexicon_size > DISPATCH_TABLE_MAX_SIZE || num_values >= UINT16_MAX)
+        return NULL;
+
+    uint16_t *table = malloc(lexicon_size * sizeof(uint16_t));
+    CHECK(table, "could not allocate dispatch table");
+
+    for (uint64_t i = 0; i < lexicon_size; i++)
+        table[i] = num_values;
+
+    /* going backwards, so that the first clause wins if values repeat */
+    for (int i = num_values - 1; i >= 0; i--)
+        if (value_ids[i] >= 0 && value_ids[i] < lexicon_size)
+            table[value_ids[i]] = i;
+
+    *size = lexicon_size;
+    return table;
+}
+
 /*
  * Get value id by name.
  * Returns 0 if value does not exist.
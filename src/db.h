@@ -2,6 +2,10 @@
 
 void db_open(db_t *db, const char *traildb_path, const char *filter);
 void db_close(db_t *db);
+Pvoid_t db_get_lookup_table(db_t *db, int field_id);
+void db_set_projection(db_t *db, const char **fields, int num_fields);
+void db_add_prefilter(db_t *db, const char **fields, const char **values, int num_terms);
+int db_get_item_field(const db_t *db, int key);
 
 /*
  * See fns_imported.h for the rest of db_ functions
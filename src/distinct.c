@@ -1,3 +1,4 @@
+#include <string.h>
 #include <traildb.h>
 #include <Judy.h>
 #include <stdbool.h>
@@ -7,6 +8,7 @@
 #include "distinct.h"
 #include "safeio.h"
 #include "ctx.h"
+#include "match_internal.h"
 
 #if DEBUG
 #define DBG_PRINTF(msg, ...) fprintf(stderr, msg, ##__VA_ARGS__);
@@ -18,13 +20,117 @@
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
 
+#define WORD_BITS 64
+
+static inline void bitvec_set(bitvec_t *bitvec, uint64_t i)
+{
+    uint64_t w = i / WORD_BITS;
+    bitvec->words[w] |= 1ULL << (i % WORD_BITS);
+    bitvec->summary[w / WORD_BITS] |= 1ULL << (w % WORD_BITS);
+}
+
+void distinct_vals_init(bitvec_t *bitvec, int num_tuples)
+{
+    bitvec->num_words = (num_tuples + WORD_BITS - 1) / WORD_BITS;
+    uint64_t num_summary = (bitvec->num_words + WORD_BITS - 1) / WORD_BITS;
+
+    /* allocate at least one word, so that lookups never need a size check */
+    bitvec->words = calloc(bitvec->num_words + 1, sizeof(uint64_t));
+    bitvec->summary = calloc(num_summary + 1, sizeof(uint64_t));
+    CHECK(bitvec->words && bitvec->summary, "could not allocate bitvec\n");
+}
+
+void hit_classes_init(hit_classes_t *classes, int num_tuples)
+{
+    memset(classes, 0, sizeof(hit_classes_t));
+
+    classes->class_of = calloc(num_tuples + 1, sizeof(uint32_t));
+    classes->touched = calloc(num_tuples + 1, sizeof(uint32_t));
+    CHECK(classes->class_of && classes->touched, "could not allocate hit classes\n");
+
+    classes->capacity = 1024;
+    classes->split_to = calloc(classes->capacity, sizeof(uint32_t));
+    classes->split_run = calloc(classes->capacity, sizeof(uint32_t));
+    CHECK(classes->split_to && classes->split_run, "could not allocate hit classes\n");
+
+    classes->num_classes = 1;
+    classes->run = 1;
+}
+
+static uint32_t hit_classes_new(hit_classes_t *classes)
+{
+    if (classes->num_classes == classes->capacity) {
+        uint32_t capacity = classes->capacity * 2;
+
+        classes->split_to = realloc(classes->split_to, capacity * sizeof(uint32_t));
+        classes->split_run = realloc(classes->split_run, capacity * sizeof(uint32_t));
+        CHECK(classes->split_to && classes->split_run, "could not allocate hit classes\n");
+
+        memset(&classes->split_run[classes->capacity], 0,
+               (capacity - classes->capacity) * sizeof(uint32_t));
+        classes->capacity = capacity;
+    }
+
+    /* items moved to a new class stay there until the next run */
+    uint32_t c = classes->num_classes++;
+    classes->split_to[c] = c;
+    classes->split_run[c] = classes->run;
+    return c;
+}
+
+/*
+ * Split classes by a run of events: items that match it are moved to new
+ * classes, one for every class they were in.
+ */
+static void hit_classes_split(hit_classes_t *classes, const uint32_t *items,
+                              int num_items)
+{
+    if (++classes->run == 0) {
+        memset(classes->split_run, 0, classes->capacity * sizeof(uint32_t));
+        classes->run = 1;
+    }
+
+    for (int i = 0; i < num_items; i++) {
+        uint32_t item = items[i];
+        uint32_t old = classes->class_of[item];
+
+        if (old == 0)
+            classes->touched[classes->num_touched++] = item;
+
+        if (classes->split_run[old] != classes->run) {
+            uint32_t c = hit_classes_new(classes);
+            classes->split_to[old] = c;
+            classes->split_run[old] = classes->run;
+        }
+
+        classes->class_of[item] = classes->split_to[old];
+    }
+}
+
+void hit_classes_clear(hit_classes_t *classes)
+{
+    for (uint32_t i = 0; i < classes->num_touched; i++)
+        classes->class_of[classes->touched[i]] = 0;
+
+    classes->num_touched = 0;
+    classes->num_classes = 1;
+}
+
+void hit_classes_free(hit_classes_t *classes)
+{
+    free(classes->class_of);
+    free(classes->touched);
+    free(classes->split_to);
+    free(classes->split_run);
+    memset(classes, 0, sizeof(hit_classes_t));
+}
+
 void distinct_vals_get_multi(ctx_t *ctx, int num_fields,
                              int *field_ids, vti_index_t *id_map,
-                             bitvec_t *out_bitvec)
+                             bitvec_t *out_bitvec,
+                             hit_classes_t *out_classes)
 {
-    out_bitvec->judy = NULL;
     for (int i = 0; i < num_fields; i++) {
-        int rc;
         int field_id = field_ids[i];
 
         if (field_id == -1 || !vti_index_have_field(id_map, field_id))
@@ -41,10 +147,11 @@ void distinct_vals_get_multi(ctx_t *ctx, int num_fields,
          * skip going through it again.
          */
         int prev_val_id = -1;
+        int key = db_get_item_key(ctx->db, field_id);
 
         while (!ctx_end_of_trail(ctx))
         {
-            int val_id = item_get_value_id(ctx_get_item(ctx), field_id);
+            int val_id = item_get_value_id(ctx_get_item(ctx), key);
 
             ctx_advance(ctx);
 
@@ -54,15 +161,15 @@ void distinct_vals_get_multi(ctx_t *ctx, int num_fields,
                 prev_val_id = val_id;
 
             /* Get indexes of foreach array elements that include this value */
-            int *gindexes = vti_index_lookup(id_map, field_id, val_id);
-
-            if (gindexes) {
-                int *gi = gindexes;
-                while (*gi != -1) {
-                    J1S(rc, out_bitvec->judy, *gi);
-                    gi++;
-                }
-            }
+            const uint32_t *gindexes;
+            int num_gindexes = vti_index_lookup(id_map, field_id, val_id,
+                                                &gindexes);
+
+            for (int gi = 0; gi < num_gindexes; gi++)
+                bitvec_set(out_bitvec, gindexes[gi]);
+
+            if (out_classes && num_gindexes > 0)
+                hit_classes_split(out_classes, gindexes, num_gindexes);
         }
     }
 }
@@ -71,34 +178,67 @@ void distinct_vals_print(bitvec_t *bitvec)
 {
     DBG_PRINTF("distinct vals: ");
 
-    Word_t index = 0;
-    int rc;
-    J1F(rc, bitvec->judy, index);
-    while (rc) {
-        DBG_PRINTF(" %lu", index);
-        J1N(rc, bitvec->judy, index);
+    for (uint64_t w = 0; w < bitvec->num_words; w++) {
+        uint64_t bits = bitvec->words[w];
+        while (bits) {
+            DBG_PRINTF(" %lu", w * WORD_BITS + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
     }
     DBG_PRINTF("\n");
 }
 
 int non_distinct_series(int val, int limit, bitvec_t *bitvec)
 {
-    int rc;
-
-    Word_t index = val;
-    J1F(rc, bitvec->judy, index);
-    if (!rc) {
-        return limit-val;
-    } else {
-        return MIN(index, limit) - val;
+    uint64_t w = val / WORD_BITS;
+    uint64_t bits = bitvec->words[w] & (~0ULL << (val % WORD_BITS));
+
+    if (!bits) {
+        /*
+         * Nothing else in this word, find the next non-zero word using the
+         * summary. Stop as soon as we're past the limit.
+         */
+        w++;
+        uint64_t s = w / WORD_BITS;
+        uint64_t last = ((uint64_t)limit - 1) / (WORD_BITS * WORD_BITS);
+        uint64_t sbits = s <= last ?
+            bitvec->summary[s] & (~0ULL << (w % WORD_BITS)) : 0;
+
+        while (!sbits && s < last)
+            sbits = bitvec->summary[++s];
+
+        if (!sbits)
+            return limit - val;
+
+        w = s * WORD_BITS + __builtin_ctzll(sbits);
+        bits = bitvec->words[w];
+    }
+
+    uint64_t index = w * WORD_BITS + __builtin_ctzll(bits);
+    return MIN(index, (uint64_t)limit) - val;
+}
+
+void distinct_vals_clear(bitvec_t *bitvec)
+{
+    uint64_t num_summary = (bitvec->num_words + WORD_BITS - 1) / WORD_BITS;
+
+    for (uint64_t s = 0; s < num_summary; s++) {
+        uint64_t sbits = bitvec->summary[s];
+        if (!sbits)
+            continue;
+
+        while (sbits) {
+            bitvec->words[s * WORD_BITS + __builtin_ctzll(sbits)] = 0;
+            sbits &= sbits - 1;
+        }
+        bitvec->summary[s] = 0;
     }
 }
 
 void distinct_vals_free(bitvec_t *bitvec)
 {
-    int rc;
-    if (bitvec->judy) {
-       J1FA(rc, bitvec->judy);
-    }
-    bitvec->judy = NULL;
+    free(bitvec->words);
+    free(bitvec->summary);
+    bitvec->words = NULL;
+    bitvec->summary = NULL;
 }
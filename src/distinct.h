@@ -21,19 +21,66 @@
  * vectors for every field as above and OR them.
  */
 typedef struct bitvec_t {
-    Pvoid_t judy;
+    uint64_t *words;    /* bit i is set if i-th foreach item is in the trail */
+    uint64_t *summary;  /* bit w is set if words[w] is not zero */
+    uint64_t num_words;
 } bitvec_t;
 
+/*
+ * Bit vector is allocated once per thread for the whole foreach array, and
+ * cleared after every trail. Clearing only touches words that have bits set,
+ * which are found through the summary.
+ */
+void distinct_vals_init(bitvec_t *bitvec, int num_tuples);
+
+
+/*
+ * Foreach values that match exactly the same events in the trail also lead
+ * to the same final state and results, if they start from the same state,
+ * as long as the program only uses them in comparisons with their own field
+ * (see match_groupby_memoizable).
+ *
+ * Hit classes group foreach items by the events they match: items in the
+ * same class match the same events, class 0 is for items that don't appear
+ * in the trail. Classes are built by splitting them with every run of equal
+ * values in the trail, so it is as cheap as computing the bit vector.
+ */
+typedef struct hit_classes_t {
+    uint32_t *class_of;  /* class of every foreach item */
+    uint32_t *touched;   /* items with non-zero class, to clear them */
+    uint32_t num_touched;
+
+    /* class that members of a class are moved to by the current run */
+    uint32_t *split_to;
+    uint32_t *split_run;
+    uint32_t num_classes;
+    uint32_t capacity;
+    uint32_t run;
+} hit_classes_t;
+
+void hit_classes_init(hit_classes_t *classes, int num_tuples);
+
+/* reset all items to class 0, so that classes can be reused for the next trail */
+void hit_classes_clear(hit_classes_t *classes);
+
+void hit_classes_free(hit_classes_t *classes);
+
 
 /* For the case when groupby array is an array of tuples.
 
  * Since buf contains only local value ids, id_map helps to translate these
  * to groupby array indexes that contain them.
+ *
+ * If out_classes is not NULL, hit classes of foreach items are computed too.
  */
 void distinct_vals_get_multi(ctx_t *ctx, int num_fields,
                              int *field_ids,
                              vti_index_t *id_map,
-                             bitvec_t *out_bitvec);
+                             bitvec_t *out_bitvec,
+                             hit_classes_t *out_classes);
+
+/* reset all bits, so that bitvec can be reused for the next trail */
+void distinct_vals_clear(bitvec_t *bitvec);
 
 /* free */
 void distinct_vals_free(bitvec_t *bitvec);
@@ -7,6 +7,7 @@ typedef void * set_t;
 typedef struct ctx_t ctx_t;
 typedef struct db_t db_t;
 typedef struct hyperloglog_t hyperloglog_t;
+typedef struct id_set_t id_set_t;
 
 /*
  * These structures are generated by the trck compiler. They are opaque for
@@ -63,6 +64,16 @@ void match_save_result(results_t *results, void *arg,
                        void (*save_set)(void *, char *, set_t *),
                        void (*save_multiset)(void *, char *, set_t *),
                        void (*save_hll)(void *, char *, hyperloglog_t *));
+
+/*
+ * Inverse of match_save_result: values returned by the callbacks are added
+ * to the result structure.
+ */
+void match_load_result(results_t *results, void *arg,
+                       int64_t (*load_int)(void *, char *),
+                       void (*load_set)(void *, char *, set_t *),
+                       void (*load_multiset)(void *, char *, set_t *),
+                       hyperloglog_t *(*load_hll)(void *, char *));
 /*
  * Get the size of result_t structure in bytes.
  */
@@ -74,6 +85,6 @@ size_t match_get_result_size();
  */
 int match_get_param_id(const char *param);
 int match_set_param(int param_id, int value, kvids_t *ids, char *val_str, int val_str_len);
-int match_set_list_param(int param_id, Pvoid_t value, kvids_t *ids);
+int match_set_list_param(int param_id, id_set_t *value, kvids_t *ids);
 char *match_get_param_field(int param_id);
 
@@ -21,6 +21,13 @@ typedef const void *item_t;
 int db_get_key_id(const char *, db_t *);
 int db_get_value_id(const char *, int, int, db_t *);
 
+/* Key to use with item_get_value_id() for a field id, see db_set_projection */
+int db_get_item_key(const db_t *, int);
+
+/* Value id -> clause index table for a field, see compile_dispatch in fsm2c */
+uint16_t *db_get_dispatch_table(db_t *db, int field_id, const int *value_ids,
+                                int num_values, uint64_t *size);
+
 
 /*
  ******************************************************************************
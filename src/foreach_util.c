@@ -25,20 +25,17 @@ int scalar_to_local(db_t *db, int field_id, const char *value, int len)
 /*
  * Convert a set of string values to a set of db-specific ("local") ids.
  */
-Pvoid_t set_to_local(db_t *db, int field_id, string_val_t *values, int len)
+id_set_t *set_to_local(db_t *db, int field_id, string_val_t *values, int len)
 {
+    int *ids = malloc((len ? len : 1) * sizeof(int));
+    CHECK(ids, "cannot allocate set value ids");
 
-    Pvoid_t set = NULL;
-    for(int i = 0; i < len; i++) {
-        /* get value id */
-        int v = scalar_to_local(db, field_id, values[i].str, values[i].len);
+    /* get value ids, invalid ones are skipped by id_set_create */
+    for(int i = 0; i < len; i++)
+        ids[i] = scalar_to_local(db, field_id, values[i].str, values[i].len);
 
-        /* if valid, insert into set */
-        int Rc_int;
-        if (v > 0) {
-            J1S(Rc_int, set, v);
-        }
-    }
+    id_set_t *set = id_set_create(ids, len);
+    free(ids);
     return set;
 }
 
@@ -47,25 +44,34 @@ Pvoid_t set_to_local(db_t *db, int field_id, string_val_t *values, int len)
  */
 id_value_t *groupby_ids_create(const groupby_info_t *gi, db_t *db)
 {
-    /* walk through string tuples and convert them to traildb value id tuples */
     id_value_t *res = calloc(gi->num_tuples * gi->num_vars, sizeof(id_value_t));
     CHECK(res, "cannot allocate local groupby id array");
 
+    groupby_ids_translate(gi, db, res, 0, gi->num_tuples);
+    return res;
+}
+
+void groupby_ids_translate(const groupby_info_t *gi, db_t *db, id_value_t *res,
+                           int start, int end)
+{
+    /* walk through string tuples and convert them to traildb value id tuples */
     tdb_field field_ids[gi->num_vars];
-    tdb_field field;
     for (int j = 0; j < gi->num_vars; j++) {
         field_ids[j] = -1;
         if (gi->var_fields[j])
             tdb_get_field(db->db, gi->var_fields[j], &field_ids[j]); /* this may fail, that's ok */
     }
 
-    id_value_t *out = res;
-    for (int i = 0; i < gi->num_tuples; i++) {
+    id_value_t *out = &res[start * gi->num_vars];
+    for (int i = start; i < end; i++) {
         for (int j = 0; j < gi->num_vars; j++) {
             int field_id = field_ids[j];
 
             if (field_id == -1) {
-                out->id = -1;
+                if (gi->var_names[j][0] == '#')
+                    out->id_set = NULL;
+                else
+                    out->id = -1;
                 out++;
                 continue;
             }
@@ -93,8 +99,6 @@ id_value_t *groupby_ids_create(const groupby_info_t *gi, db_t *db)
             }
         }
     }
-
-    return res;
 }
 
 void groupby_ids_free(const groupby_info_t *gi, id_value_t *id_tuples)
@@ -102,15 +106,12 @@ void groupby_ids_free(const groupby_info_t *gi, id_value_t *id_tuples)
     for (int i = 0; i < gi->num_tuples; i++) {
         id_value_t *tuple = &id_tuples[i * gi->num_vars];
         for (int j = 0; j < gi->num_vars; j++) {
-            int rc;
-
             switch (gi->var_names[j][0]) {
                 case '%':
                     /* do nothing */
                     break;
                 case '#':
-                    if (tuple[j].id_set != NULL)
-                        J1FA(rc, tuple[j].id_set);
+                    id_set_free(tuple[j].id_set);
                     break;
             }
         }
@@ -118,149 +119,160 @@ void groupby_ids_free(const groupby_info_t *gi, id_value_t *id_tuples)
     free(id_tuples);
 }
 
-void vti_index_create(vti_index_t *idx, const groupby_info_t *gi,
-                      id_value_t *id_tuples, tdb *db)
+void vti_index_init(vti_index_t *idx, const groupby_info_t *gi, tdb *db)
 {
-
-    /*
-     * Walk through id_tuples and create a mapping from value id to a list of
-     * tuple indices.
-     */
-    tdb_field field_ids[gi->num_vars];
+    idx->num_fields = tdb_num_fields(db);
+    idx->num_vars = gi->num_vars;
+    idx->var_field_ids = calloc(gi->num_vars + 1, sizeof(int));
+    idx->num_values = calloc(idx->num_fields, sizeof(uint64_t));
+    idx->offsets = calloc(idx->num_fields, sizeof(uint32_t *));
+    idx->tuples = calloc(idx->num_fields, sizeof(uint32_t *));
+    CHECK(idx->var_field_ids && idx->num_values && idx->offsets && idx->tuples,
+          "cannot allocate vti field indexes\n");
 
     for (int j = 0; j < gi->num_vars; j++) {
-        field_ids[j] = -1;
+        tdb_field field_id;
 
-        if (gi->var_fields[j])
-            tdb_get_field(db, gi->var_fields[j], &field_ids[j]); /* this may fail, if field has no "type" */
-    }
+        idx->var_field_ids[j] = -1;
 
-    /*
-     * First go through id_tuples and create mapping as
-     *
-     *    field id -> value id -> judy set of tuple indexes
-     *
-     * Then we convert judy sets to int *arrays as they are more convenient
-     * during matching.
-     */
-    Pvoid_t *tmp = calloc(tdb_num_fields(db), sizeof(Pvoid_t));
-    CHECK(tmp, "cannot allocate temp vti index\n");
+        /* this may fail, if field has no "type" */
+        if (!gi->var_fields[j] || tdb_get_field(db, gi->var_fields[j], &field_id))
+            continue;
 
-    for (int i = 0; i < gi->num_tuples; i++) {
-        id_value_t *tuple = &id_tuples[i * gi->num_vars];
+        /* timestamps can't be foreach values */
+        if (field_id == 0)
+            continue;
 
-        PWord_t pv;
-        int rc, rc2;
-        Word_t index;
+        idx->var_field_ids[j] = field_id;
+
+        if (idx->offsets[field_id])
+            continue;
+
+        /*
+         * Counts of tuples for value v are accumulated in offsets[v + 2],
+         * see vti_index_layout for why.
+         */
+        idx->num_values[field_id] = tdb_lexicon_size(db, field_id);
+        idx->offsets[field_id] = calloc(idx->num_values[field_id] + 2,
+                                        sizeof(uint32_t));
+        CHECK(idx->offsets[field_id], "cannot allocate vti offsets\n");
+    }
+}
+
+/*
+ * Go through values of tuples [start, end). Either count tuples for every
+ * value, or, if 'fill' is set, add tuple indexes to their places.
+ */
+static void vti_index_add(vti_index_t *idx, const groupby_info_t *gi,
+                          const id_value_t *id_tuples, int start, int end,
+                          bool fill)
+{
+    for (int i = start; i < end; i++) {
+        const id_value_t *tuple = &id_tuples[i * gi->num_vars];
 
         for (int j = 0; j < gi->num_vars; j++) {
-            int field_id = field_ids[j];
+            int field_id = idx->var_field_ids[j];
+            const uint32_t *set_ids = NULL;
+            uint64_t num_ids = 0;
+            uint64_t value_id = 0;
 
-            if (field_id <= 0)
+            if (field_id == -1)
                 continue;
 
+            uint32_t *offsets = idx->offsets[field_id];
+
             switch (gi->var_names[j][0]) {
                 case '%':
-                    JLI(pv, tmp[field_id], tuple[j].id);
-                    J1S(rc, *(Pvoid_t *)pv, i);
-                    CHECK(*pv != 0, "woo");
+                    value_id = tuple[j].id;
+                    num_ids = tuple[j].id >= 0;
                     break;
                 case '#':
-                    index = 0;
-                    J1F(rc, tuple[j].id_set, index);
-                    while (rc) {
-                        JLI(pv, tmp[field_id], index);
-                        J1S(rc2, *(Pvoid_t *)pv, i);
-                        J1N(rc, tuple[j].id_set, index);
+                    if (tuple[j].id_set) {
+                        set_ids = tuple[j].id_set->values;
+                        num_ids = tuple[j].id_set->num_values;
                     }
                     break;
             }
-        }
-    }
-
-
-    idx->by_field_id = calloc(tdb_num_fields(db), sizeof(Pvoid_t));
-    idx->num_fields = tdb_num_fields(db);
-    CHECK(idx->by_field_id, "cannot allocate vti field indexes\n");
-
-    for (int f = 0; f < tdb_num_fields(db); f++) {
-        PWord_t pid_set;
-        Word_t value_id = 0;
-
-        JLF(pid_set, tmp[f], value_id);
 
-        while (pid_set) {
-            Pvoid_t id_set = *(Pvoid_t *)pid_set;
-
-            /* get judy set of tuple indices */
-            Word_t set_size;
-            J1C(set_size, id_set, 0, -1);
-
-            /* allocate linear array to fit all the values (terminated by -1) */
-            uint32_t *id_array = malloc(sizeof(uint32_t) * (set_size + 1));
-            CHECK(id_array, "cannot allocate id array");
-
-            /* copy items to the array */
-            Word_t set_index = 0;
-            int rc;
-            uint32_t *out = id_array;
-            J1F(rc, id_set, set_index);
-            while(rc) {
-                *out = set_index;
-                out++;
-                J1N(rc, id_set, set_index);
+            for (uint64_t k = 0; k < num_ids; k++) {
+                if (set_ids)
+                    value_id = set_ids[k];
+
+                if (fill) {
+                    uint32_t pos = __atomic_fetch_add(&offsets[value_id + 1], 1,
+                                                      __ATOMIC_RELAXED);
+                    idx->tuples[field_id][pos] = i;
+                } else {
+                    __atomic_fetch_add(&offsets[value_id + 2], 1,
+                                       __ATOMIC_RELAXED);
+                }
             }
-            *out = -1;
-
-            /* free temporary judy set */
-            J1FA(rc, id_set);
+        }
+    }
+}
 
-            /* insert value into idx map for this field */
-            PWord_t out_pv;
-            JLI(out_pv, idx->by_field_id[f], value_id);
-            *(uint32_t **)out_pv = id_array;
+void vti_index_count(vti_index_t *idx, const groupby_info_t *gi,
+                     const id_value_t *id_tuples, int start, int end)
+{
+    vti_index_add(idx, gi, id_tuples, start, end, false);
+}
 
-            JLN(pid_set, tmp[f], value_id);
+void vti_index_layout(vti_index_t *idx)
+{
+    for (int f = 0; f < idx->num_fields; f++) {
+        uint32_t *offsets = idx->offsets[f];
+
+        if (!offsets)
+            continue;
+
+        /*
+         * After the prefix sum, offsets[v + 1] is where tuples of value v
+         * start. vti_index_fill moves it forward for every tuple it adds,
+         * so when all tuples are added it points to the end of value v,
+         * which is also the start of v + 1, as expected by lookups.
+         */
+        uint64_t total = 0;
+        for (uint64_t v = 0; v < idx->num_values[f] + 2; v++) {
+            total += offsets[v];
+            CHECK(total <= UINT32_MAX, "too many foreach tuples for vti index\n");
+            offsets[v] = total;
         }
 
-        int rc;
-        JLFA(rc, tmp[f]);
+        idx->tuples[f] = malloc(sizeof(uint32_t) * (total + 1));
+        CHECK(idx->tuples[f], "cannot allocate vti tuples\n");
     }
-    free(tmp);
 }
 
-/*
- * Look up list of tuple indexes from the index given field_id and value id
- */
-int *vti_index_lookup(vti_index_t *index, int field_id, int val_id) {
-    CHECK(field_id < index->num_fields, "invalid field_id in vti_lookup");
-    CHECK(field_id > 0, "invalid field_id in vti_lookup: %d", field_id);
-
-    PWord_t pv;
-    JLG(pv, index->by_field_id[field_id], val_id);
-    if (pv)
-        return *(int **)pv;
-    else
-        return NULL;
+void vti_index_fill(vti_index_t *idx, const groupby_info_t *gi,
+                    const id_value_t *id_tuples, int start, int end)
+{
+    vti_index_add(idx, gi, id_tuples, start, end, true);
+}
+
+void vti_index_create(vti_index_t *idx, const groupby_info_t *gi,
+                      id_value_t *id_tuples, tdb *db)
+{
+    vti_index_init(idx, gi, db);
+    vti_index_count(idx, gi, id_tuples, 0, gi->num_tuples);
+    vti_index_layout(idx);
+    vti_index_fill(idx, gi, id_tuples, 0, gi->num_tuples);
 }
 
 int vti_index_have_field(vti_index_t *index, int field_id) {
     CHECK(field_id > 0, "invalid field_id in vti_index_have_field: %d", field_id);
-    return (index->by_field_id[field_id] == 0) ? 0 : 1;
+    CHECK(field_id < index->num_fields, "invalid field_id in vti_index_have_field: %d", field_id);
+
+    const uint32_t *offsets = index->offsets[field_id];
+    return (offsets && offsets[index->num_values[field_id]] > 0) ? 1 : 0;
 }
 
 void vti_index_free(vti_index_t *index) {
     for (int f = 0; f < index->num_fields; f++) {
-        Word_t tuple_idx = 0;
-        PWord_t pv;
-        JLF(pv, index->by_field_id[f], tuple_idx);
-        while (pv) {
-            free(*(int **)pv);
-            JLN(pv, index->by_field_id[f], tuple_idx);
-        }
-
-        int rc;
-        JLFA(rc, index->by_field_id[f]);
+        free(index->offsets[f]);
+        free(index->tuples[f]);
     }
-    free(index->by_field_id);
+    free(index->offsets);
+    free(index->tuples);
+    free(index->num_values);
+    free(index->var_field_ids);
 }
@@ -13,6 +13,7 @@
  *
  */
 #include "fns_imported.h"
+#include "id_set.h"
 
 /******** Tuple item representation ***************************************/
 
@@ -32,10 +33,10 @@ typedef struct string_val_t {
 
 /*
  * Same as above, represented as integer ids, specific for a traildb. Either
- * scalar int or Judy set.
+ * scalar int or id set.
  */
 typedef union id_value_t {
-    Pvoid_t id_set;
+    id_set_t *id_set;
     int id;
 } id_value_t;
 
@@ -45,7 +46,7 @@ typedef union id_value_t {
 /* may return -1 if value not found */
 int scalar_to_local(db_t *db, int field_id, const char *value, int length);
 
-Pvoid_t set_to_local(db_t *db, int field_id, string_val_t *values, int length);
+id_set_t *set_to_local(db_t *db, int field_id, string_val_t *values, int length);
 
 
 /*
@@ -73,6 +74,14 @@ typedef struct groupby_info_t {
 /* Convert string-based tuples to id-based tuples */
 id_value_t *groupby_ids_create(const groupby_info_t *gi, db_t *db);
 
+/*
+ * Convert tuples [start, end) into preallocated 'res'. Can be called
+ * concurrently for disjoint ranges, provided that lookup tables for all
+ * groupby fields have been built beforehand (see db_get_lookup_table).
+ */
+void groupby_ids_translate(const groupby_info_t *gi, db_t *db, id_value_t *res,
+                           int start, int end);
+
 void groupby_ids_free(const groupby_info_t *gi, id_value_t *id_tuples);
 
 /*
@@ -82,16 +91,57 @@ void groupby_ids_free(const groupby_info_t *gi, id_value_t *id_tuples);
  * some way: either as a scalar or as member of a set.
  *
  * (field_id, value_id) -> [tuple_idx ...]
+ *
+ * Value ids are dense (0 to lexicon size), so for every field this is stored
+ * in compressed sparse row format: tuples of value v are
+ *
+ *      tuples[f][offsets[f][v] .. offsets[f][v + 1])
+ *
+ * offsets[f] is NULL if no foreach variable uses field f.
  */
 typedef struct vti_index_t {
     int num_fields;
-    Pvoid_t *by_field_id; /* Array of judyL maps, one for every field */
+    int num_vars;
+    int *var_field_ids;   /* field id of every foreach variable, or -1 */
+    uint64_t *num_values; /* lexicon size of every field */
+    uint32_t **offsets;
+    uint32_t **tuples;
 } vti_index_t;
 
 void vti_index_create(vti_index_t *idx, const groupby_info_t *gi, id_value_t *id_tuples, tdb *db);
 
-/* Returned tuple index array is terminated by -1 value. */
-int *vti_index_lookup(vti_index_t *index, int field_id, int val_id);
+/*
+ * vti_index_create split into steps, so that the index can be built in
+ * parallel: vti_index_count and vti_index_fill can be called concurrently
+ * for disjoint ranges of tuples [start, end). All counts must be done before
+ * vti_index_layout, and all fills after it.
+ *
+ * When built this way, order of tuple indexes for a value is not defined.
+ */
+void vti_index_init(vti_index_t *idx, const groupby_info_t *gi, tdb *db);
+
+void vti_index_count(vti_index_t *idx, const groupby_info_t *gi,
+                     const id_value_t *id_tuples, int start, int end);
+
+void vti_index_layout(vti_index_t *idx);
+
+void vti_index_fill(vti_index_t *idx, const groupby_info_t *gi,
+                    const id_value_t *id_tuples, int start, int end);
+
+/*
+ * Returns number of tuple indexes for the value, and sets *tuples to point
+ * to them.
+ */
+static inline int vti_index_lookup(const vti_index_t *index, int field_id,
+                                   int val_id, const uint32_t **tuples)
+{
+    const uint32_t *offsets = index->offsets[field_id];
+    if ((uint64_t)val_id >= index->num_values[field_id])
+        return 0;
+
+    *tuples = &index->tuples[field_id][offsets[val_id]];
+    return offsets[val_id + 1] - offsets[val_id];
+}
 
 int vti_index_have_field(vti_index_t *index, int field_id);
 
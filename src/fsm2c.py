@@ -229,7 +229,7 @@ def enter_rule(g, ri, program):
                 g.o("state->window_expires = MIN(timestamp, state->window_expires) + %s;" % (program.get_rule_window_duration(ri)))
             with BRACES(g, "else"):
                 g.o("state->window_expires = timestamp + %s;" % (program.get_rule_window_duration(ri)))
-        else:
+        elif not program.specialized:
             g.o("state->window_expires = %s;" % EXPIRES_NEVER)
 
 
@@ -329,7 +329,8 @@ def compile_yield_term(g, term, program, current_rule_id, _val, _pval, _len, _ty
 def compile_yield(g, c, program, current_rule_id):
     if c.get("yield", None):
         g.o('DBG_PRINTF("yield %s\\n");' % repr(c['yield']).replace('%', '%%'))
-        g.o("ctx_update_stats(ctx, RESULT_UPDATED);")
+        if not program.specialized:
+            g.o("ctx_update_stats(ctx, RESULT_UPDATED);")
         for _yield in c['yield']:
             var = _yield['dst']
             if var_type(var) == 'scalar':
@@ -527,7 +528,7 @@ def preprocess_yield_term(program, term):
             preprocess_yield_term(program, a)
 
 
-def preprocess(program):
+def preprocess(program, specialize=True):
 
     # generate window block info:
     # 1) enumerate window rules in window_rule_ids
@@ -586,6 +587,15 @@ def preprocess(program):
     program.vars = list(vars | set(groupby_vars))
     program.no_rewind = is_no_rewind(program)
     program.has_window_rules = len(program.window_rule_ids) > 0
+    program.prefilter_terms = get_prefilter_terms(program)
+    program.groupby_memoizable = is_groupby_memoizable(program)
+    program.uses_timestamp = any('timestamp' in c["attrs"] for r in program.rules for c in r.get("clauses", []))
+    program.specialized = specialize and is_specializable(program)
+    program.dispatch = {}
+    for i, r in enumerate(program.rules):
+        d = get_dispatch_clauses(program, r)
+        if d is not None:
+            program.dispatch[i] = d
 
     entrypoint_id = 0
     for i, r in enumerate(program.rules):
@@ -594,6 +604,129 @@ def preprocess(program):
     program.entrypoint_id = entrypoint_id
 
 
+def get_prefilter_terms(program):
+    # If events that don't match any literal condition in the program can only
+    # ever hit a "* -> repeat" clause, they can be dropped before matching.
+    # Returns a list of (field, value) pairs an event has to match at least
+    # one of to be relevant, or None if the program doesn't allow that.
+    if program.vars or program.has_window_rules:
+        return None
+
+    terms = set()
+    for r in program.rules:
+        if r.get("window") is not None or r.get("outer"):
+            return None
+
+        has_wildcard = False
+        for c in r.get("clauses", []):
+            if c.get("op") == "not":
+                return None
+
+            conditions = [(f, e) for f, exprs in c["attrs"].items() for e in exprs]
+            if not conditions:
+                action = parse_action(c.get("action", "restart-from-here"))
+                if action.type != "repeat" or c.get("yield"):
+                    return None
+                has_wildcard = True
+                continue
+
+            for field, expr in conditions:
+                if is_special_var(program, field) or is_variable(expr):
+                    return None
+                if expr == '' or expr[0] in '<=>':
+                    return None
+                terms.add((field, expr))
+
+        if not has_wildcard:
+            return None
+
+    return sorted(terms)
+
+
+def yield_term_uses_vars(term, names):
+    if term['_k'] == 'param':
+        return term['name'] in names
+    elif term['_k'] == 'fcall':
+        return any(yield_term_uses_vars(a, names) for a in term['args'])
+    return False
+
+
+def is_groupby_memoizable(program):
+    # Foreach values that match the same events lead to the same outcome, if
+    # foreach variables are only compared to values of their own field, no two
+    # variables use the same field, and they are never compared to timestamps
+    # or yielded. The engine can then run match_trail once per such group of
+    # values, see hit_classes_t.
+    groupby_vars = set(program.groupby_vars)
+    if not groupby_vars:
+        return False
+
+    var_fields = {}
+    for r in program.rules:
+        yields = []
+        for c in r.get("clauses", []):
+            for field, conditions in c["attrs"].items():
+                for expr in conditions:
+                    expr = expr.strip().lstrip('<=>')
+                    if expr not in groupby_vars:
+                        continue
+                    if field == 'timestamp' or var_fields.setdefault(expr, field) != field:
+                        return False
+            yields += c.get('yield') or []
+        if "after" in r:
+            yields += r['after'].get('yield') or []
+
+        for _yield in yields:
+            if any(yield_term_uses_vars(t, groupby_vars) for t in _yield.get('src', [])):
+                return False
+
+    return len(set(var_fields.values())) == len(var_fields)
+
+
+# Minimum number of clauses worth a dispatch table, see get_dispatch_clauses()
+DISPATCH_MIN_CLAUSES = 4
+
+
+def get_dispatch_clauses(program, r):
+    # Clauses that compare the same field to a single literal each are just
+    # a lookup by value id. Returns the field and the literals of the longest
+    # run of such clauses at the beginning of the block, if it is long enough
+    # for a table lookup to beat comparing values one by one.
+    field = None
+    literals = []
+    for c in r.get("clauses", []):
+        conditions = [(f, e) for f, exprs in c["attrs"].items() for e in exprs]
+        if c.get("op") == "not" or len(conditions) != 1:
+            break
+
+        f, expr = conditions[0]
+        if is_special_var(program, f) or is_variable(expr) or expr[:1] in ('<', '=', '>'):
+            break
+        if field is not None and f != field:
+            break
+
+        field = f
+        literals.append(expr)
+
+    if len(literals) < DISPATCH_MIN_CLAUSES:
+        return None
+    return field, literals
+
+
+def is_specializable(program):
+    # Most programs just count events: they have no windows and no foreach or
+    # external parameters. For those match_trail doesn't need to check window
+    # expiration or track timestamps, and nobody looks at the stats hints.
+    if program.vars or program.has_window_rules:
+        return False
+
+    for r in program.rules:
+        if r.get("window") is not None or r.get("outer"):
+            return False
+
+    return True
+
+
 def is_no_rewind(program):
     # figure out if this state machine ever requires jumping back in the trail
     # makes things a lot easier if it is not
@@ -609,6 +742,20 @@ def is_no_rewind(program):
     return True
 
 
+def compile_dispatch(g, ri, program):
+    # Jump straight to the first of the dispatch clauses that matches, or past
+    # all of them, using a table built by match_db_init(). Without a table
+    # (missing field or huge lexicon), clauses are checked one by one below.
+    field, literals = program.dispatch[ri]
+    with BRACES(g, "if (ids->dispatch_r%d)" % ri):
+        g.o("int value_id = item_get_value_id(item, ids->key_%s);" % field)
+        g.o("int ci = (value_id >= 0 && (uint64_t)value_id < ids->dispatch_size_r%d) ? ids->dispatch_r%d[value_id] : %d;" % (ri, ri, len(literals)))
+        with BRACES(g, "switch (ci)"):
+            for ci in range(len(literals)):
+                g.o("case %d: goto CLAUSE_%s_%s_success;" % (ci, ri, ci))
+            g.o("default: goto AFTER_CLAUSE_r%d_c%d;" % (ri, len(literals) - 1))
+
+
 def compile_block(g, ri, r, program):
     g.o("RULE_START_r%d:" % ri)
     enter_rule(g, ri, program)
@@ -628,11 +775,19 @@ def compile_block(g, ri, r, program):
     g.o('if (ctx_end_of_trail(ctx)) goto STOP;')
     with BRACES(g, "while (1)"):
         g.o("item = ctx_get_item(ctx);")
-        g.o("timestamp = item_get_timestamp(item);")
-        g.o("/* check timestamp */")
-        g.o("bool within_window = (state->window_expires == 0 || state->window_expires > timestamp);")
-        g.o("if (within_window && !item_is_empty(item))")
+        if program.specialized:
+            # no windows to check, timestamp is only needed for conditions
+            if program.uses_timestamp:
+                g.o("timestamp = item_get_timestamp(item);")
+            g.o("if (!item_is_empty(item))")
+        else:
+            g.o("timestamp = item_get_timestamp(item);")
+            g.o("/* check timestamp */")
+            g.o("bool within_window = (state->window_expires == 0 || state->window_expires > timestamp);")
+            g.o("if (within_window && !item_is_empty(item))")
         with BRACES(g):
+            if ri in program.dispatch:
+                compile_dispatch(g, ri, program)
             for ci, c in enumerate(r["clauses"]):
                 compile_clause(g, ri, ci, c, succ="CONTINUE_r%d" % ri, fail="AFTER_CLAUSE_r%d_c%d" % (ri, ci), program=program)
                 g.o("AFTER_CLAUSE_r%d_c%d:" % (ri, ci))
@@ -672,11 +827,13 @@ def gen_prologue(g, program, includes):
     g.o("""
         #include <stdint.h>
         #include <stdbool.h>
+        #include <stdlib.h>
         #include <string.h>
         #include <stdio.h>
         #include <Judy.h>
 
         #include "fns_generated.h"
+        #include "id_set.h"
         #include "utils.h"
     """)
     for i in includes:
@@ -690,10 +847,8 @@ def gen_prologue(g, program, includes):
     g.o("#endif")
     g.o("#define MIN(x,y) ((x) < (y) ? (x) : (y))")
 
-    with BRACES(g, "bool set_contains(Pvoid_t set, int value)"):
-        g.o("int Rc_int;")
-        g.o("J1T(Rc_int, set, value);")
-        g.o("return Rc_int == 1;")
+    with BRACES(g, "static inline bool set_contains(const id_set_t *set, int value)"):
+        g.o("return id_set_contains(set, value);")
 
 
 def gen_get_param_id(g, program):
@@ -729,7 +884,7 @@ def gen_get_param_field(g, program):
 
 
 def gen_set_list_param(g, program):
-    with BRACES(g, "int match_set_list_param(int param_id, Pvoid_t value, kvids_t *ids)"):
+    with BRACES(g, "int match_set_list_param(int param_id, id_set_t *value, kvids_t *ids)"):
         for i, v in enumerate(program.vars):
             if v.startswith('#'):
                 with BRACES(g, "switch (param_id)"):
@@ -739,12 +894,15 @@ def gen_set_list_param(g, program):
 
 def gen_free_params(g, program):
     with BRACES(g, "void match_free_params(kvids_t *ids)"):
-        g.o("int Rc_word;")
+        for ri in sorted(program.dispatch):
+            g.o("free(ids->dispatch_r%d);" % ri)
+            g.o("ids->dispatch_r%d = NULL;" % ri)
         for v in program.vars:
             if var_type(v) == 'scalar':
                 g.o("ids->var_%s = -1;" % strip_type(v))
             elif var_type(v) == 'set':
-                g.o("J1FA(Rc_word, ids->var_%s) ;" % strip_type(v))
+                g.o("id_set_free(ids->var_%s);" % strip_type(v))
+                g.o("ids->var_%s = NULL;" % strip_type(v))
             else:
                 raise Exception('Invalid variable name: %s' % v)
 
@@ -819,6 +977,9 @@ def gen_structs(g, program):
             if k != 'timestamp':
                 for v in program.kvs[k]:
                     g.o("int value_%s_%s;" % (k, escape_var_name(v)))
+        for ri in sorted(program.dispatch):
+            g.o("uint16_t *dispatch_r%d;" % ri)
+            g.o("uint64_t dispatch_size_r%d;" % ri)
 
         for v in program.vars:
             if var_type(v) == 'scalar':
@@ -826,7 +987,7 @@ def gen_structs(g, program):
                 g.o("char *varstr_%s;" % strip_type(v))
                 g.o("int varstrlen_%s;" % strip_type(v))
             elif var_type(v) == 'set':
-                g.o("Pvoid_t var_%s;" % strip_type(v))
+                g.o("id_set_t *var_%s;" % strip_type(v))
             else:
                 assert(not v)
 
@@ -858,6 +1019,21 @@ def gen_print(g, program):
             g.o("save_hll(arg, \"^%s\", results->hll_%s);" % (k, k))
 
 
+def gen_load(g, program):
+    with BRACES(g, "void match_load_result(results_t *results, void *arg, int64_t (*load_int)(void *, char *), void (*load_set)(void *, char *, set_t *), void (*load_multiset)(void *, char *, set_t *), hyperloglog_t *(*load_hll)(void *, char *))"):
+        for i, k in enumerate(program.yield_counters):
+            g.o("results->%s += load_int(arg, \"%s\");" % (strip_type(k), k))
+        for i, k in enumerate(program.yield_sets):
+            g.o("load_set(arg, \"#%s\", &results->set_%s);" % (k, k))
+        for i, k in enumerate(program.yield_multisets):
+            g.o("load_multiset(arg, \"&%s\", &results->mset_%s);" % (k, k))
+        for i, k in enumerate(program.yield_hlls):
+            with BRACES(g):
+                g.o("hyperloglog_t *hll = load_hll(arg, \"^%s\");" % (k,))
+                g.o("results->hll_%s = hll_merge(results->hll_%s, hll);" % (k, k))
+                g.o("hll_free(hll);")
+
+
 def gen_db_init(g, program):
     with BRACES(g, "void match_db_init(kvids_t *ids, db_t *db)"):
         g.o('DBG_PRINTF("========== match_db_init() ===========\\n")')
@@ -871,6 +1047,18 @@ def gen_db_init(g, program):
                     g.o("ids->value_%s_%s = db_get_value_id(\"%s\", %d, ids->key_%s, db);" % (k, escape_var_name(v), v, len(v), k))
                     g.o("""DBG_PRINTF("ids->value_{k}_{v} = %d\\n", ids->value_{k}_{v});""".format(k = k, v = escape_var_name(v)))
 
+        for ri, (field, literals) in sorted(program.dispatch.items()):
+            with BRACES(g):
+                values = ', '.join("ids->value_%s_%s" % (field, escape_var_name(v)) for v in literals)
+                g.o("int value_ids[] = {%s};" % values)
+                g.o("ids->dispatch_r%d = db_get_dispatch_table(db, ids->key_%s, value_ids, %d, &ids->dispatch_size_r%d);" % (ri, field, len(literals), ri))
+
+        # value ids are looked up by field id, but items may only contain
+        # projected fields (see db_set_projection)
+        for k in program.kvs:
+            if k != 'timestamp':
+                g.o("ids->key_%s = db_get_item_key(db, ids->key_%s);" % (k, k))
+
         for v in program.vars:
             if var_type(v) == 'set':
                 g.o("ids->var_%s = NULL;" % strip_type(v))
@@ -926,9 +1114,9 @@ def gen_get_result_size(g, program):
         g.o("return sizeof(results_t);")
 
 
-def make_ast(rules, groupby):
+def make_ast(rules, groupby, specialize=True):
     program = Program(rules, groupby=groupby)
-    preprocess(program)
+    preprocess(program, specialize=specialize)
     return program
 
 
@@ -944,6 +1132,7 @@ def compile(program, includes, out=sys.stdout):
     gen_get_param_field(g, program)
     gen_free_params(g, program)
     gen_print(g, program)
+    gen_load(g, program)
     gen_match_same_state(g, program)
     gen_get_result_size(g, program)
     gen_external_function_declarations(g, program)
@@ -998,10 +1187,21 @@ def gen_header(program, groupby, out=sys.stdout):
     gen_structs(g, program)
 
     g.o("static inline bool match_no_rewind() { return %s; }" % ('true' if program.no_rewind else 'false'))
+    fields = sorted(k for k in program.kvs if k != 'timestamp')
+    g.o("static int match_num_fields = %d;" % len(fields))
+    g.o("static const char *match_fields[] = {%s};" % ','.join(('"%s"' % f) for f in fields))
+
+    # automatic event filter, see get_prefilter_terms()
+    terms = program.prefilter_terms or []
+    g.o("static int match_has_prefilter = %d;" % (0 if program.prefilter_terms is None else 1))
+    g.o("static int match_num_prefilter_terms = %d;" % len(terms))
+    g.o("static const char *match_prefilter_fields[] = {%s};" % ','.join(('"%s"' % f) for f, _ in terms))
+    g.o("static const char *match_prefilter_values[] = {%s};" % ','.join(('"%s"' % v) for _, v in terms))
     merge_results = groupby.get('merge_results', False) if groupby else False
     g.o("static int match_num_groupby_vars = %d;" % len(program.groupby_vars))
     g.o("static int match_merge_results = %d;" % (1 if merge_results else 0))
     g.o("static char *match_groupby_vars[] = {%s};" % ','.join(('"%s"' % v) for v in program.groupby_vars))
+    g.o("static int match_groupby_memoizable = %d;" % (1 if program.groupby_memoizable else 0))
     g.o("static char *match_groupby_array_param = %s;" % ('"%s"' % groupby.get('values') if groupby and 'values' in groupby else 'NULL'))
 
     free_vars = set(program.vars) - set(program.groupby_vars)
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "safeio.h"
+#include "id_set.h"
+
+static int cmp_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+id_set_t *id_set_create(const int *ids, int num_ids)
+{
+    uint32_t *values = malloc((num_ids ? num_ids : 1) * sizeof(uint32_t));
+    CHECK(values, "cannot allocate id set");
+
+    uint64_t n = 0;
+    for (int i = 0; i < num_ids; i++)
+        if (ids[i] > 0)
+            values[n++] = ids[i];
+
+    if (n == 0) {
+        free(values);
+        return NULL;
+    }
+
+    qsort(values, n, sizeof(uint32_t), cmp_uint32);
+
+    /* remove duplicates */
+    uint64_t num_values = 1;
+    for (uint64_t i = 1; i < n; i++)
+        if (values[i] != values[num_values - 1])
+            values[num_values++] = values[i];
+
+    id_set_t *set = calloc(1, sizeof(id_set_t));
+    CHECK(set, "cannot allocate id set");
+
+    set->values = values;
+    set->num_values = num_values;
+
+    uint64_t num_bits = (uint64_t)values[num_values - 1] + 1;
+    uint64_t num_words = (num_bits + 63) / 64;
+
+    if (num_words <= num_values) {
+        set->bits = calloc(num_words, sizeof(uint64_t));
+        CHECK(set->bits, "cannot allocate id set bitset");
+
+        for (uint64_t i = 0; i < num_values; i++)
+            set->bits[values[i] >> 6] |= 1ULL << (values[i] & 63);
+        set->num_bits = num_bits;
+    }
+
+    return set;
+}
+
+void id_set_free(id_set_t *set)
+{
+    if (set == NULL)
+        return;
+
+    free(set->values);
+    free(set->bits);
+    free(set);
+}
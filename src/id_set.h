@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Set of db-specific value ids, used for #set parameters and set values in
+ * foreach tuples. Membership is checked for every event, so it has to be
+ * cheap.
+ *
+ * Values are always kept as a sorted array (used for iteration). If the set
+ * is dense enough, that is the bitset covering ids up to the largest one
+ * isn't bigger than one word per value, a bitset is also built and lookups
+ * become a single bit test. Otherwise lookups are done with a branchless
+ * binary search over the sorted array.
+ */
+typedef struct id_set_t {
+    uint32_t *values;     /* sorted, no duplicates */
+    uint64_t num_values;
+
+    uint64_t *bits;       /* bit i set if i is in the set, NULL for sparse sets */
+    uint64_t num_bits;
+} id_set_t;
+
+/*
+ * Create a set from value ids in any order, possibly with duplicates. Ids that
+ * are not positive (not found in the db) are skipped. Returns NULL if no ids
+ * are left, NULL is a valid empty set.
+ */
+id_set_t *id_set_create(const int *ids, int num_ids);
+
+void id_set_free(id_set_t *set);
+
+static inline bool id_set_contains(const id_set_t *set, int value)
+{
+    if (set == NULL)
+        return false;
+
+    if (set->bits) {
+        uint64_t v = (uint64_t)(int64_t)value;
+        return v < set->num_bits && (set->bits[v >> 6] >> (v & 63)) & 1;
+    }
+
+    const uint32_t *base = set->values;
+    uint64_t n = set->num_values;
+
+    while (n > 1) {
+        uint64_t half = n / 2;
+        base = ((int64_t)base[half - 1] < value) ? base + half : base;
+        n -= half;
+    }
+    return (int64_t)*base == value;
+}
@@ -5,20 +5,50 @@
 typedef struct perf_stats_t {
     uint64_t match_calls;
     uint64_t early_breaks;
+    uint64_t memo_hits;       /* match_trail calls saved by hit classes */
+    uint64_t state_lookups;       /* reads of the global states map */
+    uint64_t state_lookups_timed; /* ... of those, timed in state_lookup_ns */
+    uint64_t state_lookup_ns;     /* time spent in timed state lookups */
 } perf_stats_t;
 
 struct db_t {
     tdb *db;
     Pvoid_t id_lookup_table[256];
     struct tdb_event_filter *filter;
+    uint64_t cursor_buffer_size; /* TDB_OPT_CURSOR_EVENT_BUFFER_SIZE */
+
+    /*
+     * Field projection: if num_slots > 0, contexts keep only the fields the
+     * program reads, and item keys are slots (1..num_slots) instead of
+     * TrailDB field ids. field_to_slot is indexed by field id, 0 means the
+     * field is not projected; slot_to_field is indexed by slot.
+     */
+    int num_slots;
+    int *field_to_slot;
+    int *slot_to_field;
+
+    /*
+     * Prefilter (see db_add_prefilter): if has_prefilter is set, contexts
+     * only keep events that contain one of prefilter_items.
+     */
+    bool has_prefilter;
+    int num_prefilter_items;
+    tdb_item *prefilter_items;
 };
 
 struct ctx_t {
     int64_t num_events;
     int64_t event_size;
 
-    uint8_t *buf;
-    size_t buf_size;
+    /*
+     * Events of the current trail. Points either into the cursor's own
+     * buffer, if the whole trail was decoded in one batch, or to the
+     * arena otherwise.
+     */
+    const uint8_t *buf;
+
+    uint8_t *arena;
+    size_t arena_size;
 
     tdb_cursor *cursor;
     uint64_t trail_id;
@@ -27,6 +57,13 @@ struct ctx_t {
 
     int64_t position;
     int stats; /* used for jit-like optimizations */
+
+    /*
+     * In streaming mode events are pulled from the cursor as the matcher
+     * advances, instead of reading the whole trail upfront. Trail can't be
+     * rewound then.
+     */
+    bool streaming;
     perf_stats_t perf_stats;
     __uint128_t cookie;
     db_t *db;
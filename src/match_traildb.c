@@ -27,6 +27,10 @@
 #include "out_traildb.h"
 #include "safeio.h"
 #include "mempool.h"
+#include "arena.h"
+#include "state_file.h"
+#include "checkpoint.h"
+#include "xxhash/xxhash.h"
 #include "statevec.h"
 #include "foreach_util.h"
 #include "distinct.h"
@@ -51,6 +55,117 @@
 #define DBG_PRINTF(msg, ...)
 #endif
 
+/*
+ * Cookie state maps are split into shards by a hash of the cookie, so that
+ * thread-local maps can be merged into the global map in parallel, one
+ * shard per thread at a time. Cookies aren't necessarily random (small
+ * integer ids, shared prefixes or suffixes), so the shard is taken from the
+ * top bits of a multiply-shift hash of both halves rather than from raw
+ * cookie bytes.
+ */
+#define NUM_STATE_SHARDS 256
+
+/*
+ * State lookups are timed for one trail in this many, and the total is
+ * extrapolated from those. A clock_gettime pair for every trail would be a
+ * noticeable share of the lookup it measures.
+ */
+#define STATE_LOOKUP_SAMPLE 64
+
+static inline struct judy_128_map *state_shard(struct judy_128_map *shards,
+                                               __uint128_t key)
+{
+    uint64_t h = (uint64_t)key ^ (uint64_t)(key >> 64);
+    return &shards[(h * 0x9E3779B97F4A7C15ULL) >> 56];
+}
+
+static uint64_t num_sharded_keys(const struct judy_128_map *shards)
+{
+    uint64_t n = 0;
+    for (int s = 0; s < NUM_STATE_SHARDS; s++)
+        n += j128m_num_keys(&shards[s]);
+    return n;
+}
+
+/*
+ * Target amount of work (events per trail times match calls per trail) in one
+ * chunk of trails handed out by the OpenMP scheduler. Small enough that threads
+ * that ran into a few huge trails don't hold up everybody else at the end of a
+ * TrailDB, large enough to keep scheduling overhead negligible.
+ */
+#define TRAIL_CHUNK_WORK 200000
+
+/* Aim for at least this many chunks per thread, even if trails are long */
+#define MIN_CHUNKS_PER_THREAD 16
+
+static uint64_t trail_chunk_size(uint64_t num_trails, double events_per_trail,
+                                 double match_calls_per_trail, size_t num_threads)
+{
+    double work_per_trail = events_per_trail * match_calls_per_trail;
+    uint64_t chunk = work_per_trail > 1 ? TRAIL_CHUNK_WORK / work_per_trail : TRAIL_CHUNK_WORK;
+    uint64_t max_chunk = num_trails / (num_threads * MIN_CHUNKS_PER_THREAD);
+
+    if (chunk > max_chunk)
+        chunk = max_chunk;
+    return chunk ? chunk : 1;
+}
+
+/*
+ * State vectors written while processing TrailDB N are allocated from
+ * generation N arenas, one per thread. States loaded from a checkpoint are
+ * generation 0. References from the states arrays are counted per
+ * generation, so that a generation can be released as a whole once none of
+ * its vectors are used anymore.
+ */
+typedef struct state_generation_t {
+    arena_t **arenas;
+    int num_arenas;
+    uint64_t num_refs; /* state map entries pointing into this generation */
+    uint64_t num_dead; /* ... that were replaced or deleted since */
+} state_generation_t;
+
+static void generation_create(state_generation_t *g, uint32_t generation, int num_arenas)
+{
+    g->arenas = malloc(num_arenas * sizeof(arena_t *));
+    CHECK(g->arenas, "could not allocate arenas\n");
+    for (int t = 0; t < num_arenas; t++)
+        g->arenas[t] = arena_create(generation);
+    g->num_arenas = num_arenas;
+    g->num_refs = 0;
+    g->num_dead = 0;
+}
+
+static void generation_release(state_generation_t *g)
+{
+    for (int t = 0; t < g->num_arenas; t++)
+        arena_destroy(g->arenas[t]);
+    free(g->arenas);
+    memset(g, 0, sizeof(state_generation_t));
+}
+
+/*
+ * Vectors of cookies that don't appear in recent TrailDBs stay in old
+ * generations, which keeps these generations alive. Once more entries have
+ * died in old generations than there are entries in the states arrays, live
+ * vectors are moved to the current generation, and all older ones are
+ * released. Moving scans all states, but that's paid for by the replacements
+ * and deletions that made the old entries dead.
+ */
+static bool should_compact_generations(const state_generation_t *gens, uint32_t cur,
+                                       uint64_t num_states)
+{
+    uint64_t num_dead = 0;
+    for (uint32_t g = 0; g < cur; g++)
+        num_dead += gens[g].num_dead;
+    return num_dead > num_states;
+}
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 /*
  * Run matcher on a dummy trail containing only one event with specified
@@ -251,6 +366,75 @@ void add_results_vec(results_t *vec, int n, results_t *value)
     }
 }
 
+/*
+ * Final states and results of match_trail for hit classes (see
+ * hit_classes_t). They are only valid for foreach values starting from the
+ * same state, so they are released after every series of those.
+ */
+typedef struct match_memo_t {
+    uint64_t series;
+    uint64_t *series_of;  /* series the class outcome was computed in */
+    state_t *states;
+    results_t *results;
+    uint32_t *used;       /* classes with outcomes in the current series */
+    uint32_t num_used;
+    uint32_t capacity;
+} match_memo_t;
+
+static void memo_reserve(match_memo_t *memo, uint32_t capacity)
+{
+    if (capacity <= memo->capacity)
+        return;
+
+    memo->series_of = realloc(memo->series_of, capacity * sizeof(uint64_t));
+    memo->states = realloc(memo->states, capacity * sizeof(state_t));
+    memo->results = realloc(memo->results, capacity * sizeof(results_t));
+    memo->used = realloc(memo->used, capacity * sizeof(uint32_t));
+    CHECK(memo->series_of && memo->states && memo->results && memo->used,
+          "could not allocate match memo\n");
+
+    memset(&memo->series_of[memo->capacity], 0,
+           (capacity - memo->capacity) * sizeof(uint64_t));
+    memo->capacity = capacity;
+}
+
+static results_t *memo_get(match_memo_t *memo, uint32_t c, state_t **state)
+{
+    if (memo->series_of[c] != memo->series)
+        return NULL;
+
+    *state = &memo->states[c];
+    return &memo->results[c];
+}
+
+static void memo_put(match_memo_t *memo, uint32_t c, const state_t *state,
+                     const results_t *results)
+{
+    memo->series_of[c] = memo->series;
+    memo->states[c] = *state;
+    memset(&memo->results[c], 0, sizeof(results_t));
+    match_add_results(&memo->results[c], results);
+    memo->used[memo->num_used++] = c;
+}
+
+static void memo_release(match_memo_t *memo)
+{
+    for (uint32_t i = 0; i < memo->num_used; i++)
+        match_free_results(&memo->results[memo->used[i]]);
+
+    memo->num_used = 0;
+    memo->series++;
+}
+
+static void memo_free(match_memo_t *memo)
+{
+    memo_release(memo);
+    free(memo->series_of);
+    free(memo->states);
+    free(memo->results);
+    free(memo->used);
+}
+
 void print_trail(ctx_t *ctx)
 {
     for (int i = 0; i < ctx->num_events; i++) {
@@ -334,6 +518,391 @@ void run_groupby_match(int groupby_idx,
     ctx->perf_stats.match_calls++;
 }
 
+/* Number of foreach tuples translated to local ids in one go */
+#define GROUPBY_IDS_BLOCK 4096
+
+/*
+ * Per-TrailDB structures that are read-only during matching and shared by
+ * all threads: the opened TrailDB with its lexicon lookup tables, the
+ * foreach tuples translated to TrailDB-specific ids, and program ids and
+ * parameters. Every thread works on its own copy of 'ids', which only
+ * differs from this one by the current foreach values.
+ */
+typedef struct prepared_db_t {
+    db_t db;
+    int *field_ids;
+    int *param_ids;
+    id_value_t *id_tuples;
+    vti_index_t vti;
+    kvids_t ids;
+} prepared_db_t;
+
+/*
+ * Open a TrailDB and build everything matching threads need from it. Can run
+ * concurrently with matching another TrailDB.
+ */
+static prepared_db_t *prepare_db(const char *traildb_path, const char *filter,
+                                 const groupby_info_t *gi, json_object *params)
+{
+    uint64_t tstart = now_ns();
+
+    prepared_db_t *p = calloc(1, sizeof(prepared_db_t));
+    CHECK(p, "could not allocate prepared db\n");
+
+    db_open(&p->db, traildb_path, filter);
+
+    /* ask the kernel to start paging the TrailDB in */
+    tdb_willneed(p->db.db);
+
+    /* field ids */
+    p->field_ids = calloc(gi->num_vars + 1, sizeof(int));
+    p->param_ids = calloc(gi->num_vars + 1, sizeof(int));
+    CHECK(p->field_ids && p->param_ids, "could not allocate field ids\n");
+
+    for (int j = 0; j < gi->num_vars; j++) {
+        tdb_field groupby_field_id = -1;
+
+        if (gi->var_fields[j]) {
+            tdb_error res = tdb_get_field(p->db.db, gi->var_fields[j],
+                                          &groupby_field_id);
+
+            if (res) {
+                fprintf(stderr, "WARNING: groupby field %s is not defined for this traildb: %s %d\n",
+                gi->var_fields[j], traildb_path, groupby_field_id);
+                groupby_field_id = -1;
+            }
+        }
+        p->field_ids[j] = groupby_field_id;
+        p->param_ids[j] = match_get_param_id(gi->var_names[j]);
+    }
+
+    /*
+     * If the program can only ever skip events that don't match any of its
+     * literals, drop them before matching.
+     */
+    if (match_has_prefilter)
+        db_add_prefilter(&p->db, match_prefilter_fields, match_prefilter_values,
+                         match_num_prefilter_terms);
+
+    /*
+     * Trails are replayed for every foreach value, so it pays off to only
+     * keep fields the program actually reads.
+     */
+    if (gi->num_vars > 0)
+        db_set_projection(&p->db, match_fields, match_num_fields);
+
+    /*
+     * Resolve ids of all values and parameters referenced by the program.
+     * This also builds lexicon lookup tables for their fields.
+     */
+    match_db_init(&p->ids, &p->db);
+    set_params_from_json(params, &p->ids, &p->db);
+
+    /*
+     * Translate foreach values (tuples) to ids specific to this traildb.
+     * Lookup tables are built upfront, so that tuples can be translated in
+     * parallel. When preparing the next TrailDB during matching, this runs
+     * single-threaded as nested parallelism is off.
+     */
+    p->id_tuples = calloc((size_t)gi->num_tuples * gi->num_vars + 1, sizeof(id_value_t));
+    CHECK(p->id_tuples, "cannot allocate local groupby id array");
+
+    if (gi->num_tuples > 0)
+        for (int j = 0; j < gi->num_vars; j++)
+            if (p->field_ids[j] != -1)
+                db_get_lookup_table(&p->db, p->field_ids[j]);
+
+    int num_blocks = (gi->num_tuples + GROUPBY_IDS_BLOCK - 1) / GROUPBY_IDS_BLOCK;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < num_blocks; b++) {
+        int end = (b + 1) * GROUPBY_IDS_BLOCK;
+        groupby_ids_translate(gi, &p->db, p->id_tuples,
+                              b * GROUPBY_IDS_BLOCK,
+                              end < gi->num_tuples ? end : gi->num_tuples);
+    }
+
+    /*
+     * Create an index mapping db-specific value id to foreach tuple: count
+     * tuples for every value, then put tuple indexes in place.
+     */
+    vti_index_init(&p->vti, gi, p->db.db);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < num_blocks; b++) {
+        int end = (b + 1) * GROUPBY_IDS_BLOCK;
+        vti_index_count(&p->vti, gi, p->id_tuples, b * GROUPBY_IDS_BLOCK,
+                        end < gi->num_tuples ? end : gi->num_tuples);
+    }
+
+    vti_index_layout(&p->vti);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < num_blocks; b++) {
+        int end = (b + 1) * GROUPBY_IDS_BLOCK;
+        vti_index_fill(&p->vti, gi, p->id_tuples, b * GROUPBY_IDS_BLOCK,
+                       end < gi->num_tuples ? end : gi->num_tuples);
+    }
+
+    fprintf(stderr, "Preparing traildb %s took %.3fs\n",
+            traildb_path, (now_ns() - tstart) / 1e9);
+    return p;
+}
+
+static void release_db(prepared_db_t *p, const groupby_info_t *gi)
+{
+    match_free_params(&p->ids);
+    vti_index_free(&p->vti);
+    groupby_ids_free(gi, p->id_tuples);
+    free(p->field_ids);
+    free(p->param_ids);
+    db_close(&p->db);
+    free(p);
+}
+
+/*
+ * Merge thread-local output states into the state file (old may be NULL
+ * before the first TrailDB) and return the new one. Empties the
+ * thread-local arrays.
+ */
+static state_file_t *spill_states(const char *path, state_file_t *old,
+                                  struct judy_128_map *local_states,
+                                  struct judy_128_map *local_empty_states,
+                                  size_t num_threads, uint64_t tag)
+{
+    uint64_t num_updates = 0;
+    for (int i = 0; i < num_threads * NUM_STATE_SHARDS; i++)
+        num_updates += j128m_num_keys(&local_states[i]) +
+                       j128m_num_keys(&local_empty_states[i]);
+
+    state_file_update_t *updates = malloc((num_updates + 1) * sizeof(state_file_update_t));
+    CHECK(updates, "could not allocate state file updates\n");
+
+    uint64_t n = 0;
+    for (int i = 0; i < num_threads * NUM_STATE_SHARDS; i++) {
+        __uint128_t idx = 0;
+        PWord_t pv = NULL;
+        j128m_find(&local_states[i], &pv, &idx);
+        while (pv != NULL) {
+            statevec_t *sv = *(statevec_t **)pv;
+            memcpy(updates[n].cookie, &idx, 16);
+            updates[n].data = sv;
+            updates[n].size = sv_size(sv);
+            n++;
+            j128m_next(&local_states[i], &pv, &idx);
+        }
+        j128m_free(&local_states[i]);
+
+        idx = 0;
+        j128m_find(&local_empty_states[i], &pv, &idx);
+        while (pv != NULL) {
+            memcpy(updates[n].cookie, &idx, 16);
+            updates[n].data = NULL;
+            updates[n].size = 0;
+            n++;
+            j128m_next(&local_empty_states[i], &pv, &idx);
+        }
+        j128m_free(&local_empty_states[i]);
+    }
+
+    state_file_write(path, old, updates, n, tag);
+    free(updates);
+    state_file_close(old);
+
+    return state_file_open(path);
+}
+
+/*
+ * Fingerprint of foreach tuples, so that results in a checkpoint aren't
+ * added to results for different tuples (e.g. implicit foreach over a
+ * lexicon that changed).
+ */
+static uint64_t groupby_fingerprint(const groupby_info_t *gi)
+{
+    XXH64_state_t h;
+    XXH64_reset(&h, 0);
+    XXH64_update(&h, &gi->num_tuples, sizeof(gi->num_tuples));
+    for (int i = 0; i < gi->num_tuples; i++) {
+        for (int j = 0; j < gi->num_vars; j++) {
+            const string_val_t *v = &gi->tuples[i * gi->num_vars + j];
+            if (gi->var_names[j][0] == '#') {
+                for (int k = 0; k < v->len; k++)
+                    XXH64_update(&h, v->str_set[k].str, v->str_set[k].len + 1);
+            } else {
+                XXH64_update(&h, v->str, v->len);
+            }
+            XXH64_update(&h, "\n", 1);
+        }
+    }
+    return XXH64_digest(&h);
+}
+
+static char *checkpoint_states_path(const char *checkpoint_path)
+{
+    char *path = malloc(strlen(checkpoint_path) + 8);
+    CHECK(path, "could not allocate path");
+    sprintf(path, "%s.states", checkpoint_path);
+    return path;
+}
+
+/*
+ * Save checkpoint after a TrailDB. States are already on disk if a state
+ * file is used, otherwise they are written to a state file next to the
+ * checkpoint.
+ */
+static void save_checkpoint(const char *path, const checkpoint_info_t *info,
+                            struct judy_128_map *states, state_file_t *state_file,
+                            results_t **thread_results, size_t num_threads)
+{
+    if (!state_file) {
+        state_file_update_t *updates = malloc((num_sharded_keys(states) + 1) *
+                                              sizeof(state_file_update_t));
+        CHECK(updates, "could not allocate checkpoint states\n");
+
+        uint64_t n = 0;
+        for (int s = 0; s < NUM_STATE_SHARDS; s++) {
+            __uint128_t idx = 0;
+            PWord_t pv = NULL;
+            j128m_find(&states[s], &pv, &idx);
+            while (pv != NULL) {
+                memcpy(updates[n].cookie, &idx, 16);
+                updates[n].data = *(statevec_t **)pv;
+                updates[n].size = sv_size(*(statevec_t **)pv);
+                n++;
+                j128m_next(&states[s], &pv, &idx);
+            }
+        }
+
+        char *states_path = checkpoint_states_path(path);
+        state_file_write(states_path, NULL, updates, n, info->num_traildbs);
+        free(states_path);
+        free(updates);
+    }
+
+    checkpoint_writer_t *w = checkpoint_write_start(path, info);
+    for (int t = 0; t < num_threads; t++) {
+        for (uint64_t j = 0; j < info->num_results; j++) {
+            if (match_is_zero_result(&thread_results[t][j]))
+                continue;
+            checkpoint_write_result(w, j);
+            match_save_result(&thread_results[t][j], w,
+                              checkpoint_save_int, checkpoint_save_set,
+                              checkpoint_save_set, checkpoint_save_hll);
+        }
+    }
+    checkpoint_write_finish(w);
+}
+
+/*
+ * Load checkpoint saved by save_checkpoint. Results are added to results,
+ * and states are either loaded into states arrays (copied into arena) or
+ * the state file is opened. Checkpoint info has to be initialized with
+ * values for the current program.
+ */
+static state_file_t *load_checkpoint(const char *path, checkpoint_info_t *info,
+                                     const char *state_file_path,
+                                     struct judy_128_map *states, arena_t *arena,
+                                     results_t *results)
+{
+    checkpoint_info_t expected = *info;
+    checkpoint_reader_t *r = checkpoint_read_start(path, info);
+
+    CHECK(info->state_size == expected.state_size &&
+          info->num_results == expected.num_results &&
+          info->groupby_fingerprint == expected.groupby_fingerprint,
+          "Checkpoint %s was created by a different program, or with different foreach values",
+          path);
+
+    uint64_t j;
+    while (checkpoint_read_result(r, &j)) {
+        CHECK(j < info->num_results, "Checkpoint %s is corrupted", path);
+        match_load_result(&results[j], r,
+                          checkpoint_load_int, checkpoint_load_set,
+                          checkpoint_load_set, checkpoint_load_hll);
+    }
+    checkpoint_read_finish(r);
+
+    char *states_path = state_file_path ? strdup(state_file_path) :
+                                          checkpoint_states_path(path);
+    state_file_t *sf = state_file_open(states_path);
+    CHECK(state_file_tag(sf) == info->num_traildbs,
+          "States in %s are from %" PRIu64 " TrailDBs, but checkpoint %s is from %" PRIu64 ". " \
+          "Was the run interrupted while saving the checkpoint?",
+          states_path, state_file_tag(sf), path, info->num_traildbs);
+    free(states_path);
+
+    fprintf(stderr, "Resuming from checkpoint %s: %" PRIu64 " traildbs, %" PRIu64 " states\n",
+            path, info->num_traildbs, state_file_num_entries(sf));
+
+    if (state_file_path)
+        return sf;
+
+    for (uint64_t i = 0; i < state_file_num_entries(sf); i++) {
+        const uint8_t *cookie;
+        const statevec_t *sv = state_file_entry(sf, i, &cookie, NULL);
+        __uint128_t idx;
+        memcpy(&idx, cookie, 16);
+        PWord_t pv = j128m_insert(state_shard(states, idx), idx);
+        CHECK(pv, "could not insert into states array\n");
+        *(statevec_t **)pv = sv_copy(sv, arena, NULL);
+    }
+    state_file_close(sf);
+    return NULL;
+}
+
+/*
+ * Run matcher with MAX_TIMESTAMP for all non-initial states in a state
+ * vector, adding results. Returns the number of matcher calls.
+ */
+static int finalize_state_vector(statevec_t *sv, const uint8_t *cookie,
+                                 const groupby_info_t *gi, results_t *results)
+{
+    int nfinalized = 0;
+    statevec_iterator_t svi;
+    sv_iterate_start(sv, &svi);
+
+    for (int j = 0; j < gi->num_tuples; /**/) {
+        int num_eq_states;
+
+        /* Get next series of equal states from state vector,
+           we only need to run matcher once for them as
+           results are guaranteed to be the same.
+        */
+        state_t *pstate = sv_iterate_next_edge(&svi, &num_eq_states);
+        if ((pstate == NULL) && (num_eq_states == -1))
+            num_eq_states = gi->num_tuples - j;
+
+        results_t r = {0};
+
+        /* We only need to run matcher for non-initial states. */
+        if (pstate && !match_is_initial_state(pstate)) {
+            match_timestamp_only(MAX_TIMESTAMP, pstate, &r, (uint8_t *)cookie);
+            nfinalized++;
+        }
+
+        results_t *output_result = gi->merge_results ? &results[0] : &results[j];
+        add_results_vec(output_result, num_eq_states, &r);
+        match_free_results(&r);
+
+        j += num_eq_states;
+        CHECK(j <= gi->num_tuples,
+            "j==groupby_cardinality num_eq_states = %d", num_eq_states);
+    }
+    return nfinalized;
+}
+
+/*
+ * Options for keeping states and results on disk, within a run or between
+ * runs.
+ */
+typedef struct persist_options_t {
+    const char *state_file;  /* keep carried states in this file */
+    const char *checkpoint;  /* save checkpoint here after every TrailDB */
+    bool resume;             /* continue from checkpoint, if it exists */
+    const char *load_state;  /* continue from this checkpoint */
+    const char *save_state;  /* save checkpoint here instead of finalizing */
+} persist_options_t;
+
 /*
  * Multi-traildb version of foreach aka groupby
  *
@@ -364,15 +933,23 @@ void run_groupby_match(int groupby_idx,
  * However, in this case most states across in a state vector would still be
  * identical; therefore we can RLE-encode the vector to save memory.
  *
- * TODO: memory management for state vectors could easily be way more efficient,
- * we just need separate pools of memory per traildb. Doesn't seem to be a
- * bottlneck yet though, despite a ton of malloc calls.
+ * State vectors are allocated from per-thread arenas, one generation per
+ * TrailDB (see state_generation_t). Vectors of cookies not seen in TrailDB N
+ * stay where they are; a generation is released in one go once all of its
+ * vectors have been replaced, instead of freeing vectors one by one.
+ *
+ * Optionally, states carried between TrailDBs are kept in a sorted,
+ * memory-mapped state file instead (see spill_states), so that memory use
+ * doesn't grow with the number of TrailDBs.
  */
 
 int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
                        json_object *params, results_t *results,
-                       const char *filter, window_set_t *window_set, exclude_set_t *exclude_set)
+                       const char *filter, window_set_t *window_set, exclude_set_t *exclude_set,
+                       const persist_options_t *opts)
 {
+    const char *state_file_path = opts->state_file;
+
     #ifdef _OPENMP
     size_t num_threads = omp_get_max_threads();
     fprintf(stderr, "max threads %d\n", (uint32_t) num_threads);
@@ -382,14 +959,40 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
     #endif
 
     /*
-     * Judy128 array for storing cookie state vectors across multiple
-     * TrailDBs. Threads read from this array, but write into
-     * thread-local output arrays. After processing a full TrailDB,
-     * the output arrays are merged into this array.
+     * Judy128 arrays (one per shard) for storing cookie state vectors
+     * across multiple TrailDBs. Threads read from these arrays, but
+     * write into thread-local output arrays. After processing a full
+     * TrailDB, the output arrays are merged into these arrays.
      */
-    struct judy_128_map *states = calloc(1, sizeof(struct judy_128_map));
+    struct judy_128_map *states = calloc(NUM_STATE_SHARDS, sizeof(struct judy_128_map));
     CHECK(states, "could not allocate states array\n");
-    j128m_init(states);
+
+    /*
+     * Thread-local output arrays, NUM_STATE_SHARDS per thread. Only used
+     * for writing the new state. The previous state is read from the
+     * global states arrays. Emptied by the merge after every TrailDB.
+     */
+    struct judy_128_map *local_states = calloc(num_threads * NUM_STATE_SHARDS,
+                                               sizeof(struct judy_128_map));
+    CHECK(local_states, "could not allocate local_states\n");
+
+    struct judy_128_map *local_empty_states = calloc(num_threads * NUM_STATE_SHARDS,
+                                                     sizeof(struct judy_128_map));
+    CHECK(local_empty_states, "could not allocate local_empty_states\n");
+
+    /*
+     * State vector generations, see state_generation_t. TrailDB di is
+     * generation di + 1.
+     */
+    state_generation_t *gens = calloc(num_paths + 1, sizeof(state_generation_t));
+    CHECK(gens, "could not allocate state generations\n");
+
+    /*
+     * With a state file, states carried between TrailDBs are kept on disk
+     * instead of the states arrays above, and merged into the file after
+     * every TrailDB. Only states of the current TrailDB are kept in memory.
+     */
+    state_file_t *state_file = NULL;
 
 
     __uint128_t *window_ids = 0;
@@ -420,16 +1023,90 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
 
     uint64_t min_ts = 0;
 
+    /*
+     * TrailDBs processed so far, including ones from a checkpoint we resumed
+     * from. These are skipped if given again, so that a resumed run can be
+     * given either the same TrailDBs, or just new ones.
+     */
+    int num_results = gi->merge_results ? 1 : gi->num_tuples;
+    checkpoint_info_t done = {
+        .state_size = sizeof(state_t),
+        .num_results = num_results,
+        .groupby_fingerprint = groupby_fingerprint(gi)
+    };
+
+    const char *load_path = opts->load_state;
+    if (opts->resume) {
+        if (access(opts->checkpoint, F_OK) == 0)
+            load_path = opts->checkpoint;
+        else
+            fprintf(stderr, "Checkpoint %s not found, starting from scratch\n",
+                    opts->checkpoint);
+    }
+
+    if (load_path) {
+        generation_create(&gens[0], 0, 1);
+        state_file = load_checkpoint(load_path, &done, state_file_path,
+                                     states, gens[0].arenas[0], thread_results[0]);
+        gens[0].num_refs = num_sharded_keys(states);
+        min_ts = done.min_ts;
+    }
+
+    char **todo_paths = malloc((num_paths + 1) * sizeof(char *));
+    CHECK(todo_paths, "could not allocate traildb paths\n");
+    int num_todo = 0;
+    for (int i = 0; i < num_paths; i++) {
+        bool is_done = false;
+        for (uint64_t j = 0; j < done.num_traildbs; j++)
+            is_done |= (strcmp(done.traildb_paths[j], traildb_paths[i]) == 0);
+        if (is_done)
+            fprintf(stderr, "Skipping traildb %s, already in checkpoint\n", traildb_paths[i]);
+        else
+            todo_paths[num_todo++] = traildb_paths[i];
+    }
+    traildb_paths = todo_paths;
+    num_paths = num_todo;
+
+    /*
+     * Observed number of match calls per trail in the previous TrailDB,
+     * used to estimate the amount of work per trail.
+     */
+    double match_calls_per_trail = 1.0;
+
+    /*
+     * TrailDBs are processed as a pipeline: while threads match trails in
+     * TrailDB N, one of them opens and prepares TrailDB N+1.
+     */
+    prepared_db_t *cur = NULL;
+    if (num_paths > 0) {
+        fprintf(stderr, "Opening traildb %s\n", traildb_paths[0]);
+        cur = prepare_db(traildb_paths[0], filter, gi, params);
+    }
+
     for (int di = 0; di < num_paths; di++) {
         uint64_t tstart = (uint32_t) time(NULL);
         const char *traildb_path = traildb_paths[di];
-        fprintf(stderr, "Opening traildb %s\n", traildb_path);
+        prepared_db_t *next = NULL;
 
         perf_stats_t db_perf_stats = {0};
 
         uint64_t num_windows_applied = 0;
         uint64_t num_trails_done_global = 0;
         uint64_t state_size_global = 0;
+        uint64_t merge_start = 0;
+        uint64_t merge_ns = 0;
+        uint64_t busy_ns_global = 0;
+        uint64_t idle_ns_global = 0;
+
+        state_generation_t *cur_gen = &gens[di + 1];
+        generation_create(cur_gen, di + 1, num_threads);
+        arena_t **cur_arenas = cur_gen->arenas;
+
+        /*
+         * Identical state vectors are stored once per generation, and
+         * shared by all cookies that have them.
+         */
+        sv_intern_table_t *interned = sv_intern_create();
 
         /* Anything in the next block is executed in parallel by all threads */
         #pragma omp parallel
@@ -440,65 +1117,61 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
         uint32_t tid = 0;
         #endif
 
-
-        db_t db;
-        db_open(&db, traildb_path, filter);
-
-        /* field ids */
-        int field_ids[gi->num_vars];
-        int param_ids[gi->num_vars];
-
-        for (int j = 0; j < gi->num_vars; j++) {
-            tdb_field groupby_field_id = -1;
-
-            if (gi->var_fields[j]) {
-                tdb_error res = tdb_get_field(db.db, gi->var_fields[j],
-                                              &groupby_field_id);
-
-                if (res) {
-                    fprintf(stderr, "WARNING: groupby field %s is not defined for this traildb: %s %d\n",
-                    gi->var_fields[j], traildb_path, groupby_field_id);
-                    groupby_field_id = -1;
-                }
-            }
-            field_ids[j] = groupby_field_id;
-            param_ids[j] = match_get_param_id(gi->var_names[j]);
+        /*
+         * Prefetch the next TrailDB. The thread doing this joins
+         * matching when it's done.
+         */
+        #pragma omp single nowait
+        if (di + 1 < num_paths) {
+            fprintf(stderr, "Opening traildb %s\n", traildb_paths[di + 1]);
+            next = prepare_db(traildb_paths[di + 1], filter, gi, params);
         }
 
-        /* Translate foreach values (tuples) to ids specific to this traildb */
-        id_value_t *id_tuples = groupby_ids_create(gi, &db);
+        db_t *db = &cur->db;
+        int *field_ids = cur->field_ids;
+        int *param_ids = cur->param_ids;
+        id_value_t *id_tuples = cur->id_tuples;
+        vti_index_t *vti = &cur->vti;
+
+        struct judy_128_map *thread_states = &local_states[tid * NUM_STATE_SHARDS];
+        struct judy_128_map *thread_empty_states = &local_empty_states[tid * NUM_STATE_SHARDS];
 
+        /*
+         * Create a "cursor".
+         */
+        ctx_t ctx;
+        ctx_init(&ctx, db);
 
         /*
-         * Thread-local states array. Only used for writing the new
-         * state. The previous state is read from the global states
-         * array.
+         * Without foreach, every trail is matched exactly once, so if the
+         * program never rewinds, events can be decoded on demand. Programs
+         * that stop early then never decode the rest of the trail.
          */
-        struct judy_128_map *local_states = calloc(1, sizeof(struct judy_128_map));
-        CHECK(local_states, "could not allocate local_states\n");
-        j128m_init(local_states);
+        ctx_set_streaming(&ctx, match_no_rewind() && gi->num_vars == 0);
 
-        struct judy_128_map *local_empty_states = calloc(1, sizeof(struct judy_128_map));
-        CHECK(local_empty_states, "could not allocate local_empty_states\n");
-        j128m_init(local_empty_states);
+        statevec_constructor_t out_svc = {0};
 
         /*
-         * Create an index mapping db-specific value id to foreach tuple.
+         * Distinct_vals holds information about distinct foreach values
+         * within current trail, computed lazily for every trail.
          */
-        vti_index_t vti;
-        vti_index_create(&vti, gi, id_tuples, db.db);
+        bitvec_t distinct_vals;
+        distinct_vals_init(&distinct_vals, gi->num_tuples);
 
         /*
-         * Create a "cursor".
+         * If the program allows, foreach values that match the same events
+         * share outcomes of match_trail, see hit_classes_t.
          */
-        ctx_t ctx;
-        ctx_init(&ctx, &db);
+        hit_classes_t hit_classes;
+        match_memo_t memo = {.series = 1};
+        hit_classes_t *classes = NULL;
 
-        statevec_constructor_t out_svc = {0};
+        if (match_groupby_memoizable) {
+            hit_classes_init(&hit_classes, gi->num_tuples);
+            classes = &hit_classes;
+        }
 
-        kvids_t ids;
-        match_db_init(&ids, &db);
-        set_params_from_json(params, &ids, &db);
+        kvids_t ids = cur->ids;
 
         struct timeval tval1;
         gettimeofday(&tval1, NULL);
@@ -506,7 +1179,8 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
         uint64_t num_trails_done = 0;
         uint64_t state_size = 0;
 
-        fprintf(stderr, "Opening traildb took %" PRIu64 " seconds (tid=%d)\n", time(NULL) - tstart, tid);
+        /* position of the last lookup in the state file */
+        uint64_t state_file_hint = 0;
 
         uint64_t num_trails = 0;
 
@@ -521,9 +1195,25 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
         if (window_set)
             num_trails = num_windows;
         else
-            num_trails = tdb_num_trails(db.db);
+            num_trails = tdb_num_trails(db->db);
 
-        #pragma omp for schedule(static)
+        /*
+         * Trail lengths are heavily skewed, so trails are handed out to
+         * threads in chunks on demand rather than split statically. Chunk
+         * size is chosen based on the average amount of work per trail.
+         */
+        double events_per_trail = tdb_num_trails(db->db) ?
+            (double)tdb_num_events(db->db) / tdb_num_trails(db->db) : 0;
+        uint64_t chunk_size = trail_chunk_size(num_trails,
+                                               events_per_trail,
+                                               match_calls_per_trail,
+                                               num_threads);
+        if (tid == 0)
+            fprintf(stderr, "scheduling trails in chunks of %" PRIu64 "\n", chunk_size);
+
+        uint64_t loop_start = now_ns();
+
+        #pragma omp for schedule(dynamic, chunk_size) nowait
         for (uint64_t i = 0; i < num_trails; i++) {
             const uint8_t *cookie;
             __uint128_t id = 0;
@@ -541,7 +1231,7 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
                 cookie = (uint8_t *)&out_cookie;
                 id = window_ids[i];
 
-                if (tdb_get_trail_id(db.db, cookie, &trail_id) != 0)
+                if (tdb_get_trail_id(db->db, cookie, &trail_id) != 0)
                     continue; /* cookie not found in the traildb */
 
                 // We need to use the original id type (be it an id or cookie) to look up the start/end times, because
@@ -549,7 +1239,7 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
                 window_set_get(window_set, (uint8_t *)&window_ids[i], &window_start, &window_end);
             } else {
                 trail_id = i;
-                cookie = tdb_get_uuid(db.db, trail_id);
+                cookie = tdb_get_uuid(db->db, trail_id);
                 id = *(__uint128_t *)cookie;
             }
 
@@ -560,17 +1250,37 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
             ctx_read_trail(&ctx, trail_id, id, window_start, window_end);
 
             /*
-             * Get state vector for this cookie from global input
-             * array
+             * Matching an empty trail leaves states as they are and yields
+             * nothing, so there's nothing to store for this cookie either.
              */
-            PWord_t pv;
+            if (ctx_trail_is_empty(&ctx)) {
+                num_trails_done++;
+                continue;
+            }
 
-            #pragma omp critical
-            {
-            pv = j128m_get(states, *(__uint128_t *)cookie);
+            /*
+             * Get state vector for this cookie from global input
+             * array. No lock needed here: states is only modified after
+             * the barrier below, so while trails are being matched it is
+             * an immutable snapshot of the previous TrailDBs.
+             */
+            bool time_lookup = ctx.perf_stats.state_lookups++ % STATE_LOOKUP_SAMPLE == 0;
+            uint64_t lookup_start = time_lookup ? now_ns() : 0;
+            PWord_t pv = NULL;
+            statevec_t *in_sv = NULL;
+            if (state_file_path) {
+                in_sv = (statevec_t *)state_file_get(state_file, cookie,
+                                                     &state_file_hint);
+            } else {
+                pv = j128m_get(state_shard(states, *(__uint128_t *)cookie),
+                               *(__uint128_t *)cookie);
+                in_sv = pv ? *(statevec_t **)pv : NULL;
+            }
+            if (time_lookup) {
+                ctx.perf_stats.state_lookup_ns += now_ns() - lookup_start;
+                ctx.perf_stats.state_lookups_timed++;
             }
 
-            statevec_t *in_sv = pv ? *(statevec_t **)pv : NULL;
             statevec_iterator_t svi;
             sv_iterate_start(in_sv, &svi);
             sv_create(&out_svc, gi->num_tuples);
@@ -608,11 +1318,6 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
              */
 
 
-            /*
-             * Distinct_vals holds information about distinct foreach values
-             * within current trail, initialized lazily
-             */
-            bitvec_t distinct_vals;
             bool got_distinct_vals = false;
 
             for (int j = 0; j < gi->num_tuples; /**/) {
@@ -669,10 +1374,18 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
                     /* compute distinct values if we haven't yet done this for current trail */
                     if (!got_distinct_vals) {
                         distinct_vals_get_multi(&ctx, gi->num_vars,
-                                                field_ids, &vti, &distinct_vals);
+                                                field_ids, vti, &distinct_vals,
+                                                classes);
                         got_distinct_vals = true;
+
+                        if (classes)
+                            memo_reserve(&memo, classes->num_classes);
                     }
 
+                    /* value we've just matched is a member of its class, too */
+                    if (classes && classes->class_of[j - 1])
+                        memo_put(&memo, classes->class_of[j - 1], pstate, &r);
+
                     /*
                      * Memoized result and final state for foreach values that
                      * do not appear in current in trail (computed below).
@@ -697,6 +1410,21 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
                          * for that value
                          */
                         if (ndn == 0) {
+                            state_t *memo_state;
+                            results_t *memo_results = NULL;
+                            uint32_t c = classes ? classes->class_of[k] : 0;
+
+                            if (c)
+                                memo_results = memo_get(&memo, c, &memo_state);
+
+                            if (memo_results) {
+                                match_add_results(output_result, memo_results);
+                                sv_append(&out_svc, memo_state, 1);
+                                ctx.perf_stats.memo_hits++;
+                                k++;
+                                continue;
+                            }
+
                             results_t r = {0};
                             run_groupby_match(k,
                                               saved_state, gi,
@@ -704,6 +1432,9 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
                                               &st, &r,
                                               &ctx, &ids);
 
+                            if (c)
+                                memo_put(&memo, c, &st, &r);
+
                             match_add_results(output_result, &r);
                             sv_append(&out_svc, &st, 1);
                             match_free_results(&r);
@@ -738,13 +1469,17 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
                     DBG_PRINTF("==== next diff state %d\n", next_diff_state);
                     j = next_diff_state;
                     match_free_results(&ndr);
+                    memo_release(&memo);
                 }
 
                 match_free_results(&r);
             }
 
-            if (got_distinct_vals)
-                distinct_vals_free(&distinct_vals);
+            if (got_distinct_vals) {
+                distinct_vals_clear(&distinct_vals);
+                if (classes)
+                    hit_classes_clear(classes);
+            }
 
             num_trails_done++;
             if (num_trails_done % 1000000 == 0) {
@@ -758,11 +1493,12 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
                     tval_diff.tv_usec += 1000000;
                 }
 
-                fprintf(stderr, "%ld.%03ld s per 1M cookies, %.1f match calls per cookie (%" PRIu64 "), %" PRIu64 " times groupby not used, %.1f bytes of state per cookie, thread %d\n",
+                fprintf(stderr, "%ld.%03ld s per 1M cookies, %.1f match calls per cookie (%" PRIu64 "), %" PRIu64 " times groupby not used, %" PRIu64 " memoized, %.1f bytes of state per cookie, thread %d\n",
                         (long int)tval_diff.tv_sec, (long int)tval_diff.tv_usec,
                         ctx.perf_stats.match_calls/100000.,
                         ctx.perf_stats.match_calls,
                         ctx.perf_stats.early_breaks,
+                        ctx.perf_stats.memo_hits,
                         (double)state_size / num_trails_done,
                         tid);
 
@@ -773,12 +1509,14 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
 
                 ctx.perf_stats.match_calls = 0;
                 ctx.perf_stats.early_breaks = 0;
+                ctx.perf_stats.memo_hits = 0;
             }
 
 
             uint64_t state_vec_size = 0;
 
-            statevec_t *out_sv = sv_finish(&out_svc, &state_vec_size);
+            statevec_t *out_sv = sv_finish_interned(&out_svc, interned, cur_arenas[tid],
+                                                    &state_vec_size);
 
             state_size += state_vec_size;
             /*
@@ -786,98 +1524,256 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
              * not empty.
              */
             if (out_sv) {
-                pv = j128m_insert(local_states, *(__uint128_t *)cookie);
+                pv = j128m_insert(state_shard(thread_states, *(__uint128_t *)cookie),
+                                  *(__uint128_t *)cookie);
                 *(statevec_t **)pv = out_sv;
             } else {
-                pv = j128m_insert(local_empty_states, *(__uint128_t *)cookie);
+                pv = j128m_insert(state_shard(thread_empty_states, *(__uint128_t *)cookie),
+                                  *(__uint128_t *)cookie);
                 *pv = 1;
             }
         }
 
 
+        uint64_t loop_end = now_ns();
+
         sv_free_constructor(&out_svc);
-        match_free_params(&ids);
-        vti_index_free(&vti);
+        distinct_vals_free(&distinct_vals);
+        if (classes)
+            hit_classes_free(classes);
+        memo_free(&memo);
         ctx_free(&ctx);
-        /* groupby_ids_free(gi, id_tuples); */
-
-        min_ts = tdb_max_timestamp(db.db);
-
-        db_close(&db);
 
         /*
          * Wait for all threads to finish the loop before we start
-         * modifying the global states Judy array
+         * modifying the global states Judy arrays
          */
+        uint64_t wait_start = now_ns();
         #pragma omp barrier
+        uint64_t wait_ns = now_ns() - wait_start;
+
+        #pragma omp master
+        merge_start = now_ns();
 
         /*
-         * Merge thread-local states into global states array,
-         * used for reading states in the next TrailDB
+         * Merge thread-local states into global states arrays, used for
+         * reading states in the next TrailDB. Each shard is merged by a
+         * single thread, from all thread-local arrays. A cookie occurs in
+         * only one trail per TrailDB, so the order of threads doesn't
+         * matter. Replaced and deleted state vectors are simply dropped and
+         * counted as dead in their generation, their memory goes away with
+         * the generation. Vectors of cookies that don't occur in this
+         * TrailDB are not touched.
+         *
+         * With a state file, thread-local states are merged into the file
+         * after the parallel section instead.
          */
-        #pragma omp critical
-        {
-            __uint128_t idx = 0;
-            PWord_t pv = NULL;
-            j128m_find(local_states, &pv, &idx);
-            while (pv != NULL)
-            {
-                PWord_t global_pv = j128m_insert(states, idx);
-                CHECK(global_pv, "could not insert into states array\n");
-                *global_pv = *pv;
-                j128m_next(local_states, &pv, &idx);
+        uint64_t *num_dead = calloc(di + 1, sizeof(uint64_t));
+        CHECK(num_dead, "could not allocate dead counters\n");
+        uint64_t num_refs = 0;
+
+        if (!state_file_path) {
+            #pragma omp for schedule(dynamic)
+            for (int s = 0; s < NUM_STATE_SHARDS; s++) {
+                for (int t = 0; t < num_threads; t++) {
+                    struct judy_128_map *src = &local_states[t * NUM_STATE_SHARDS + s];
+                    __uint128_t idx = 0;
+                    PWord_t pv = NULL;
+                    j128m_find(src, &pv, &idx);
+                    while (pv != NULL)
+                    {
+                        PWord_t global_pv = j128m_insert(&states[s], idx);
+                        CHECK(global_pv, "could not insert into states array\n");
+                        if (*global_pv)
+                            num_dead[arena_generation_of((statevec_t *)*global_pv)]++;
+                        *global_pv = *pv;
+                        num_refs++;
+                        j128m_next(src, &pv, &idx);
+                    }
+                    j128m_free(src);
+
+                    /* delete stuff */
+                    src = &local_empty_states[t * NUM_STATE_SHARDS + s];
+                    idx = 0;
+                    j128m_find(src, &pv, &idx);
+                    while (pv != NULL)
+                    {
+                        PWord_t global_pv = j128m_get(&states[s], idx);
+                        if (global_pv) {
+                            num_dead[arena_generation_of((statevec_t *)*global_pv)]++;
+                            j128m_del(&states[s], idx);
+                        }
+                        j128m_next(src, &pv, &idx);
+                    }
+                    j128m_free(src);
+                }
             }
-            j128m_free(local_states);
-            free(local_states);
+        }
 
-            /* delete stuff */
-            j128m_find(local_empty_states, &pv, &idx);
-            while (pv != NULL)
-            {
-                j128m_del(states, idx);
-                j128m_next(local_empty_states, &pv, &idx);
-            }
-            j128m_free(local_empty_states);
-            free(local_empty_states);
+        #pragma omp master
+        merge_ns = now_ns() - merge_start;
 
+        #pragma omp critical
+        {
             db_perf_stats.match_calls += ctx.perf_stats.match_calls;
+            db_perf_stats.state_lookup_ns += ctx.perf_stats.state_lookup_ns;
+            db_perf_stats.state_lookups += ctx.perf_stats.state_lookups;
+            db_perf_stats.state_lookups_timed += ctx.perf_stats.state_lookups_timed;
 
             num_trails_done_global += num_trails_done;
 
             state_size_global += state_size;
 
+            busy_ns_global += loop_end - loop_start;
+            idle_ns_global += wait_ns;
+
+            cur_gen->num_refs += num_refs;
+            for (int g = 0; g <= di; g++)
+                gens[g].num_dead += num_dead[g];
         }
+        free(num_dead);
 
 
         } // omp parallel
 
+        if (state_file_path) {
+            uint64_t spill_start = now_ns();
+            state_file = spill_states(state_file_path, state_file,
+                                      local_states, local_empty_states,
+                                      num_threads, done.num_traildbs + 1);
+            merge_ns = now_ns() - spill_start;
+
+            /* everything we need is in the file now */
+            generation_release(cur_gen);
+        }
+
+        /* release generations that are no longer referenced */
+        for (int g = 0; g <= di; g++)
+            if (gens[g].arenas && gens[g].num_dead == gens[g].num_refs)
+                generation_release(&gens[g]);
+
+        if (!state_file_path && should_compact_generations(gens, di + 1, num_sharded_keys(states))) {
+            uint64_t compact_start = now_ns();
+
+            /* only the thread merging a shard allocates from its arena */
+            #pragma omp parallel
+            {
+            #ifdef _OPENMP
+            uint32_t tid = omp_get_thread_num();
+            #else
+            uint32_t tid = 0;
+            #endif
+            uint64_t num_moved = 0;
+            uint64_t state_size = 0;
+
+            #pragma omp for schedule(dynamic)
+            for (int s = 0; s < NUM_STATE_SHARDS; s++) {
+                __uint128_t idx = 0;
+                PWord_t pv = NULL;
+                j128m_find(&states[s], &pv, &idx);
+                while (pv != NULL)
+                {
+                    statevec_t *sv = *(statevec_t **)pv;
+                    if (arena_generation_of(sv) != di + 1) {
+                        uint64_t state_vec_size = 0;
+                        *(statevec_t **)pv = sv_intern(interned, sv, cur_arenas[tid],
+                                                       &state_vec_size);
+                        state_size += state_vec_size;
+                        num_moved++;
+                    }
+                    j128m_next(&states[s], &pv, &idx);
+                }
+            }
+
+            #pragma omp critical
+            {
+                cur_gen->num_refs += num_moved;
+                state_size_global += state_size;
+            }
+            } // omp parallel
+
+            for (int g = 0; g <= di; g++)
+                if (gens[g].arenas)
+                    generation_release(&gens[g]);
+
+            merge_ns += now_ns() - compact_start;
+        }
+
+        sv_intern_free(interned);
+
+        min_ts = tdb_max_timestamp(cur->db.db);
+        release_db(cur, gi);
+        cur = next;
+
+        done.traildb_paths = realloc(done.traildb_paths,
+                                     (done.num_traildbs + 1) * sizeof(char *));
+        CHECK(done.traildb_paths, "could not allocate traildb paths\n");
+        done.traildb_paths[done.num_traildbs++] = strdup(traildb_path);
+        done.min_ts = min_ts;
+
+        if (opts->checkpoint) {
+            uint64_t checkpoint_start = now_ns();
+            save_checkpoint(opts->checkpoint, &done, states, state_file,
+                            thread_results, num_threads);
+            fprintf(stderr, "Saving checkpoint %s took %.3fs\n",
+                    opts->checkpoint, (now_ns() - checkpoint_start) / 1e9);
+        }
+
         uint32_t tend = (uint32_t) time(NULL);
 
-        uint64_t num_states = j128m_num_keys(states);
+        if (num_trails_done_global)
+            match_calls_per_trail = (double)db_perf_stats.match_calls / num_trails_done_global;
+
+        double state_lookup_ns = db_perf_stats.state_lookups_timed ?
+            (double)db_perf_stats.state_lookup_ns * db_perf_stats.state_lookups /
+            db_perf_stats.state_lookups_timed : 0;
+
+        uint64_t num_states = state_file_path ?
+                              state_file_num_entries(state_file) :
+                              num_sharded_keys(states);
         fprintf(stderr, "done processing traildb %s, " \
                         "%" PRIu64 "s wallclock, " \
+                        "%.3fs merging states, " \
                         "%" PRIu64 " state vectors, " \
                         "%" PRIu64 " match calls, " \
                         "%" PRIu64 " windows applied, " \
                         "to %" PRIu64 " cookies, " \
-                        "%" PRIu64 " MiB state size\n",
+                        "%" PRIu64 " MiB state size, " \
+                        "%.3fs busy, %.3fs idle, " \
+                        "~%.3fs in state lookups (all threads)\n",
                 traildb_path,
                 (tend - tstart),
+                merge_ns / 1e9,
                 num_states,
                 db_perf_stats.match_calls,
                 num_windows_applied,
                 num_trails_done_global,
-                state_size_global / (1024*1024));
+                state_size_global / (1024*1024),
+                busy_ns_global / 1e9,
+                idle_ns_global / 1e9,
+                state_lookup_ns / 1e9);
     }
 
 
+    /*
+     * In incremental mode, open states and results so far are saved for the
+     * next run, which continues where this one stopped. States are not
+     * finalized, so the results we output don't include matches that
+     * would only be complete at the end of all data.
+     */
+    if (opts->save_state) {
+        uint64_t save_start = now_ns();
+        save_checkpoint(opts->save_state, &done, states, state_file,
+                        thread_results, num_threads);
+        fprintf(stderr, "Saving states to %s took %.3fs\n",
+                opts->save_state, (now_ns() - save_start) / 1e9);
+    }
+
     time_t tstart = time(NULL);
 
     /*
      * Merge thread results into output results
      */
-    int num_results = gi->merge_results ? 1 : gi->num_tuples;
-
     for (int t = 0; t < num_threads; t++) {
         for (uint64_t j = 0; j < num_results; j++) {
             if (!match_is_zero_result(&thread_results[t][j]))
@@ -895,56 +1791,48 @@ int run_groupby_query2(char **traildb_paths, int num_paths, groupby_info_t *gi,
 
     /*
      * Finalize open states for cookies that have unfinished state but they
-     * were not in the last traildb.
+     * were not in the last traildb. Skipped if states were saved for the
+     * next run.
      */
+    bool finalize = !opts->save_state;
 
 
     tstart = time(NULL);
 
-    __uint128_t idx = 0;
+    free(local_states);
+    free(local_empty_states);
+
     int nfinalized = 0;
-    PWord_t pv = NULL;
-    j128m_find(states, &pv, &idx);
-    while (pv != NULL)
-        {
-        statevec_iterator_t svi;
-        sv_iterate_start(*(statevec_t **)pv, &svi);
-
-        for (int j = 0; j < gi->num_tuples; /**/) {
-            int num_eq_states;
-
-            /* Get next series of equal states from state vector,
-               we only need to run matcher once for them as
-               results are guaranteed to be the same.
-            */
-            state_t *pstate = sv_iterate_next_edge(&svi, &num_eq_states);
-            if ((pstate == NULL) && (num_eq_states == -1))
-                num_eq_states = gi->num_tuples - j;
-
-            results_t r = {0};
-
-            /* We only need to run matcher for non-initial states. */
-            if (pstate && !match_is_initial_state(pstate)) {
-                uint8_t cookie[16] = {0};
-                memcpy(cookie, &idx, 16);
-                match_timestamp_only(MAX_TIMESTAMP, pstate, &r, cookie);
-                nfinalized++;
-            }
+    for (int s = 0; s < NUM_STATE_SHARDS; s++) {
+        __uint128_t idx = 0;
+        PWord_t pv = NULL;
+        j128m_find(&states[s], &pv, &idx);
+        while (finalize && pv != NULL) {
+            uint8_t cookie[16] = {0};
+            memcpy(cookie, &idx, 16);
+            nfinalized += finalize_state_vector(*(statevec_t **)pv, cookie, gi, results);
+            j128m_next(&states[s], &pv, &idx);
+        }
+        j128m_free(&states[s]);
+    }
+    free(states);
 
-            results_t *output_result = gi->merge_results ? &results[0] : &results[j];
-            add_results_vec(output_result, num_eq_states, &r);
-            match_free_results(&r);
+    for (uint64_t i = 0; finalize && i < state_file_num_entries(state_file); i++) {
+        const uint8_t *cookie;
+        statevec_t *sv = (statevec_t *)state_file_entry(state_file, i, &cookie, NULL);
+        nfinalized += finalize_state_vector(sv, cookie, gi, results);
+    }
+    state_file_close(state_file);
 
-            j += num_eq_states;
-            CHECK(j <= gi->num_tuples,
-                "j==groupby_cardinality num_eq_states = %d", num_eq_states);
-        }
-        sv_free(*(statevec_t **)pv);
-        j128m_next(states, &pv, &idx);
+    for (int g = 0; g <= num_paths; g++) {
+        if (gens[g].arenas)
+            generation_release(&gens[g]);
     }
-    j128m_free(states);
+    free(gens);
 
     free(window_ids);
+    free(todo_paths);
+    checkpoint_info_free(&done);
 
     tend = time(NULL);
     fprintf(stderr, "finalizing states took %ld\n", tend-tstart);
@@ -1097,7 +1985,8 @@ int run_query(char **traildb_paths, int num_paths,
               const char *params_config_file,
               const char *filter, output_format_t format,
               const char *window_file,
-              const char *exclude_file)
+              const char *exclude_file,
+              const persist_options_t *persist)
 {
     json_object *json_params = NULL;
 
@@ -1128,7 +2017,7 @@ int run_query(char **traildb_paths, int num_paths,
     }
 
     run_groupby_query2(traildb_paths, num_paths, &gi, json_params,
-                       results, filter, window_set, exclude_set);
+                       results, filter, window_set, exclude_set, persist);
 
     switch (format) {
         case FORMAT_JSON:
@@ -1165,11 +2054,13 @@ int parse_args(int argc, char **argv,
                char **filter,
                char **format,
                char **window_file,
-               char **exclude_file)
+               char **exclude_file,
+               persist_options_t *persist)
 {
     *params_config_file = 0;
     *window_file = 0;
     *exclude_file = 0;
+    memset(persist, 0, sizeof(persist_options_t));
     *filter = 0;
     *format = 0;
 
@@ -1182,6 +2073,11 @@ int parse_args(int argc, char **argv,
             {"filter",    required_argument, 0,   'f' },
             {"window-file",required_argument, 0,   'w' },
             {"exclude-file",required_argument, 0,   'e' },
+            {"state-file",required_argument, 0,   's' },
+            {"checkpoint",required_argument, 0,   'c' },
+            {"resume",    no_argument,       0,   'r' },
+            {"load-state",required_argument, 0,   'l' },
+            {"save-state",required_argument, 0,   'S' },
             {0,           0,                 0,    0 }
         };
 
@@ -1196,8 +2092,15 @@ int parse_args(int argc, char **argv,
           case 'w': *window_file = optarg; break;
           case 'e': *exclude_file = optarg; break;
           case 'o': *format = optarg; break;
+          case 's': persist->state_file = optarg; break;
+          case 'c': persist->checkpoint = optarg; break;
+          case 'r': persist->resume = true; break;
+          case 'l': persist->load_state = optarg; break;
+          case 'S': persist->save_state = optarg; break;
       }
     }
+    CHECK(!persist->resume || persist->checkpoint, "--resume requires --checkpoint");
+    CHECK(!persist->resume || !persist->load_state, "--resume and --load-state can't be used together");
     CHECK(optind < argc, "required: traildb path");
 
     return argc - optind;
@@ -1231,17 +2134,19 @@ void initialize() {
 int main(int argc, char **argv)
 {
     char *params_config_file, *filter, *format, *window_file, *exclude_file;
+    persist_options_t persist;
 
     int num_dbs = parse_args(argc, argv,
                              &params_config_file,
-                             &filter, &format, &window_file, &exclude_file);
+                             &filter, &format, &window_file, &exclude_file,
+                             &persist);
 
     if (num_dbs == 0) {
         fprintf(stderr, "usage: %s TRAILDB_PATH [groupby FIELD]\n", argv[0]);
         return 1;
     }
 
-    if (num_dbs > 1 && !match_no_rewind()) {
+    if ((num_dbs > 1 || persist.resume || persist.load_state) && !match_no_rewind()) {
         fprintf(stderr, "programs using rewind (restart-from-start) are currently not supported with multiple traildbs\n");
         return 1;
     }
@@ -1252,7 +2157,8 @@ int main(int argc, char **argv)
               filter,
               parse_format(format),
               window_file,
-              exclude_file);
+              exclude_file,
+              &persist);
     finalize();
     return 0;
 }
@@ -0,0 +1,285 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Judy.h>
+
+#include "safeio.h"
+#include "state_file.h"
+
+#define STATE_FILE_MAGIC "TRCKSTF2"
+
+typedef struct state_file_header_t {
+    char magic[8];
+    uint64_t tag;
+    uint64_t num_entries;
+    uint64_t data_offset;
+    uint64_t data_size;
+} state_file_header_t;
+
+typedef struct state_file_entry_t {
+    uint8_t cookie[16];
+    uint64_t offset; /* relative to data_offset */
+    uint64_t size;
+} state_file_entry_t;
+
+struct state_file_t {
+    const uint8_t *map;
+    uint64_t map_size;
+    const state_file_header_t *header;
+    const state_file_entry_t *index;
+    const uint8_t *data;
+};
+
+/*
+ * Compare cookies as 128-bit integers, the same order as judy_128_map keys
+ * and trails in a TrailDB.
+ */
+static inline int compare_cookies(const uint8_t *a, const uint8_t *b)
+{
+    __uint128_t x, y;
+    memcpy(&x, a, 16);
+    memcpy(&y, b, 16);
+    return (x > y) - (x < y);
+}
+
+state_file_t *state_file_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        DIE("Could not open state file %s\n", path);
+
+    struct stat st;
+    if (fstat(fd, &st))
+        DIE("Could not stat state file %s\n", path);
+
+    CHECK(st.st_size >= sizeof(state_file_header_t),
+          "State file %s is truncated", path);
+
+    state_file_t *sf = calloc(1, sizeof(state_file_t));
+    CHECK(sf, "could not allocate state file");
+
+    sf->map_size = st.st_size;
+    sf->map = mmap(NULL, sf->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (sf->map == MAP_FAILED)
+        DIE("Could not mmap state file %s\n", path);
+    close(fd);
+
+    sf->header = (const state_file_header_t *)sf->map;
+    CHECK(memcmp(sf->header->magic, STATE_FILE_MAGIC, 8) == 0,
+          "%s is not a state file", path);
+    CHECK(sf->header->data_offset + sf->header->data_size == sf->map_size &&
+          sizeof(state_file_header_t) +
+          sf->header->num_entries * sizeof(state_file_entry_t) == sf->header->data_offset,
+          "State file %s is corrupted", path);
+
+    sf->index = (const state_file_entry_t *)(sf->map + sizeof(state_file_header_t));
+    sf->data = sf->map + sf->header->data_offset;
+
+    /* lookups mostly go in file order */
+    madvise((void *)sf->map, sf->map_size, MADV_SEQUENTIAL);
+    return sf;
+}
+
+void state_file_close(state_file_t *sf)
+{
+    if (sf) {
+        munmap((void *)sf->map, sf->map_size);
+        free(sf);
+    }
+}
+
+uint64_t state_file_num_entries(const state_file_t *sf)
+{
+    return sf ? sf->header->num_entries : 0;
+}
+
+uint64_t state_file_tag(const state_file_t *sf)
+{
+    return sf->header->tag;
+}
+
+const uint8_t *state_file_get(const state_file_t *sf, const uint8_t *cookie,
+                              uint64_t *hint)
+{
+    uint64_t n = state_file_num_entries(sf);
+    if (n == 0)
+        return NULL;
+
+    /* find the range [lo, hi) containing cookie */
+    uint64_t lo = 0;
+    uint64_t hi = n;
+    if (hint && *hint < n && compare_cookies(sf->index[*hint].cookie, cookie) <= 0) {
+        /* gallop forward from the hint */
+        uint64_t step = 1;
+        lo = *hint;
+        while (lo + step < n && compare_cookies(sf->index[lo + step].cookie, cookie) <= 0) {
+            lo += step;
+            step *= 2;
+        }
+        hi = (lo + step < n) ? lo + step : n;
+    }
+
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (compare_cookies(sf->index[mid].cookie, cookie) <= 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    if (hint)
+        *hint = lo;
+
+    if (compare_cookies(sf->index[lo].cookie, cookie) == 0)
+        return sf->data + sf->index[lo].offset;
+    return NULL;
+}
+
+const uint8_t *state_file_entry(const state_file_t *sf, uint64_t i,
+                                const uint8_t **cookie, uint64_t *size)
+{
+    if (cookie)
+        *cookie = sf->index[i].cookie;
+    if (size)
+        *size = sf->index[i].size;
+    return sf->data + sf->index[i].offset;
+}
+
+static int compare_updates(const void *a, const void *b)
+{
+    return compare_cookies(((const state_file_update_t *)a)->cookie,
+                           ((const state_file_update_t *)b)->cookie);
+}
+
+/*
+ * Merge-join old entries with sorted updates, calling emit for every entry of
+ * the new file. Returns the number of entries.
+ */
+typedef void (*emit_fn)(const uint8_t *cookie, const uint8_t *data, uint64_t size,
+                        Pvoid_t *dedup, Word_t dedup_key, void *state);
+
+static uint64_t merge_join(const state_file_t *old,
+                           const state_file_update_t *updates, uint64_t num_updates,
+                           emit_fn emit, void *state,
+                           Pvoid_t *old_dedup, Pvoid_t *new_dedup)
+{
+    uint64_t num_old = state_file_num_entries(old);
+    uint64_t i = 0, j = 0, n = 0;
+
+    while (i < num_old || j < num_updates) {
+        int cmp;
+        if (i == num_old)
+            cmp = 1;
+        else if (j == num_updates)
+            cmp = -1;
+        else
+            cmp = compare_cookies(old->index[i].cookie, updates[j].cookie);
+
+        if (cmp < 0) {
+            const state_file_entry_t *e = &old->index[i++];
+            if (emit)
+                emit(e->cookie, old->data + e->offset, e->size,
+                     old_dedup, (Word_t)e->offset, state);
+            n++;
+        } else {
+            /* update replaces old entry, if any */
+            if (cmp == 0)
+                i++;
+            const state_file_update_t *u = &updates[j++];
+            if (u->data) {
+                if (emit)
+                    emit(u->cookie, u->data, u->size,
+                         new_dedup, (Word_t)u->data, state);
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+typedef struct writer_t {
+    const char *path;
+    FILE *index;
+    FILE *data;
+    uint64_t data_size;
+} writer_t;
+
+static void emit_entry(const uint8_t *cookie, const uint8_t *data, uint64_t size,
+                       Pvoid_t *dedup, Word_t dedup_key, void *state)
+{
+    writer_t *w = (writer_t *)state;
+    state_file_entry_t e;
+    memcpy(e.cookie, cookie, 16);
+    e.size = size;
+
+    /* stored offsets are shifted by one, so that zero means "not written" */
+    PWord_t pv;
+    JLI(pv, *dedup, dedup_key);
+    CHECK(pv, "could not insert into dedup map");
+    if (*pv) {
+        e.offset = *pv - 1;
+    } else {
+        e.offset = w->data_size;
+        SAFE_WRITE(data, size, w->path, w->data);
+        w->data_size += size;
+        *pv = e.offset + 1;
+    }
+    SAFE_WRITE(&e, sizeof(e), w->path, w->index);
+}
+
+void state_file_write(const char *path, const state_file_t *old,
+                      state_file_update_t *updates, uint64_t num_updates,
+                      uint64_t tag)
+{
+    qsort(updates, num_updates, sizeof(state_file_update_t), compare_updates);
+
+    uint64_t num_entries = merge_join(old, updates, num_updates,
+                                      NULL, NULL, NULL, NULL);
+
+    char tmp_path[strlen(path) + 5];
+    sprintf(tmp_path, "%s.tmp", path);
+
+    writer_t w = {.path = tmp_path};
+    if (!(w.index = fopen(tmp_path, "w")))
+        DIE("Could not create state file %s\n", tmp_path);
+    if (!(w.data = fopen(tmp_path, "r+")))
+        DIE("Could not open state file %s\n", tmp_path);
+
+    state_file_header_t header = {0};
+    uint64_t data_offset = sizeof(header) + num_entries * sizeof(state_file_entry_t);
+    SAFE_SEEK(w.index, sizeof(header), tmp_path);
+    SAFE_SEEK(w.data, data_offset, tmp_path);
+
+    Pvoid_t old_dedup = NULL;
+    Pvoid_t new_dedup = NULL;
+    merge_join(old, updates, num_updates, emit_entry, &w, &old_dedup, &new_dedup);
+
+    Word_t freed;
+    JLFA(freed, old_dedup);
+    JLFA(freed, new_dedup);
+
+    SAFE_FLUSH(w.data, tmp_path);
+    SAFE_CLOSE(w.data, tmp_path);
+
+    memcpy(header.magic, STATE_FILE_MAGIC, 8);
+    header.tag = tag;
+    header.num_entries = num_entries;
+    header.data_offset = data_offset;
+    header.data_size = w.data_size;
+    SAFE_SEEK(w.index, 0, tmp_path);
+    SAFE_WRITE(&header, sizeof(header), tmp_path, w.index);
+    SAFE_FLUSH(w.index, tmp_path);
+
+    if (fsync(fileno(w.index)))
+        DIE("Syncing %s failed\n", tmp_path);
+    SAFE_CLOSE(w.index, tmp_path);
+
+    if (rename(tmp_path, path))
+        DIE("Renaming %s to %s failed\n", tmp_path, path);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * On-disk store of cookie state vectors, sorted by cookie and accessed
+ * through mmap.
+ *
+ * State vectors are opaque byte strings here. Entries are sorted by cookie
+ * as a 128-bit little-endian integer, which is also the order of trails in a
+ * TrailDB, so looking up cookies in trail order reads the file sequentially.
+ *
+ * File layout is
+ *
+ *      header | index (num_entries x state_file_entry_t) | data
+ *
+ * Identical vectors (same pointer in the updates, or same offset in the
+ * previous file) are stored only once.
+ */
+
+typedef struct state_file_t state_file_t;
+
+/* A new state vector for a cookie. NULL data deletes the cookie. */
+typedef struct state_file_update_t {
+    uint8_t cookie[16];
+    const uint8_t *data;
+    uint64_t size;
+} state_file_update_t;
+
+/* Open and map existing state file. */
+state_file_t *state_file_open(const char *path);
+
+void state_file_close(state_file_t *sf);
+
+uint64_t state_file_num_entries(const state_file_t *sf);
+
+/* Tag given to state_file_write, e.g. number of TrailDBs processed. */
+uint64_t state_file_tag(const state_file_t *sf);
+
+/*
+ * Get state vector for a cookie, or NULL if not found. If hint is not NULL,
+ * search starts from *hint, and *hint is updated to the found position. This
+ * makes lookups in increasing cookie order cheap.
+ */
+const uint8_t *state_file_get(const state_file_t *sf, const uint8_t *cookie,
+                              uint64_t *hint);
+
+/* Get i-th entry in cookie order. */
+const uint8_t *state_file_entry(const state_file_t *sf, uint64_t i,
+                                const uint8_t **cookie, uint64_t *size);
+
+/*
+ * Write a new state file to path, containing entries of old (may be NULL)
+ * with updates applied. Updates are sorted in place. The file is written
+ * next to path and renamed over it when complete, so path always contains a
+ * complete state file. old can be a mapping of path. Tag is stored in the
+ * header as is.
+ */
+void state_file_write(const char *path, const state_file_t *old,
+                      state_file_update_t *updates, uint64_t num_updates,
+                      uint64_t tag);
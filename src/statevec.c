@@ -1,14 +1,22 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <Judy.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "fns_generated.h"
 #include "fns_imported.h"
 
 #include "statevec.h"
+#include "arena.h"
 #include "out_traildb.h"
 #include "safeio.h"
+#include "xxhash/xxhash.h"
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -38,6 +46,19 @@
  *     {nonempty, 1} A {empty, 3} {nonempty, 2} B {nonempty, 1} C {0}
  *
  *
+ * For huge foreach cardinalities, vectors are often a few non-empty states
+ * scattered among millions of empty ones. RLE spends a counter on every
+ * run, and empty runs longer than MAX_COUNTER_VALUE have to be split, so
+ * there is an alternative sparse encoding:
+ *
+ *     {0} <varint number of states> (<varint gap> <state>)...
+ *
+ * Gap is the number of empty states since the previous non-empty state.
+ * A RLE vector can never start with a zero counter, so it tags the sparse
+ * encoding. sv_finish picks whichever encoding is smaller. The example above
+ * is encoded as
+ *
+ *     {0} 4 0 A 3 B 0 B 0 C
  */
 
 sv_counter_t make_counter(int n, bool is_empty_state)
@@ -58,11 +79,121 @@ int counter_get_count(sv_counter_t c)
     return c & (sv_counter_t)MAX_COUNTER_VALUE;
 }
 
+/* LEB128 varints, used by the sparse encoding */
+static inline int varint_size(uint64_t v)
+{
+    int n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline uint8_t *varint_write(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static inline const uint8_t *varint_read(const uint8_t *p, uint64_t *v)
+{
+    uint64_t res = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        res |= (uint64_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    res |= (uint64_t)*p++ << shift;
+    *v = res;
+    return p;
+}
+
+static inline bool is_sparse(const statevec_t *sv)
+{
+    sv_counter_t c;
+    memcpy(&c, sv, sizeof(sv_counter_t));
+    return c == 0;
+}
+
+/* Decode the gap of the next sparse item, if any */
+static void sparse_next_item(statevec_iterator_t *svi)
+{
+    if (svi->num_left == 0)
+        return;
+    uint64_t gap;
+    svi->sv = (uint8_t *)varint_read(svi->sv, &gap);
+    svi->next_index = svi->pos + gap;
+}
+
 /* Initialize iterator. */
 void sv_iterate_start(statevec_t *sv, statevec_iterator_t *svi)
 {
     svi->i = 0;
     svi->sv = sv;
+    svi->sparse = false;
+
+    if (sv && is_sparse(sv)) {
+        svi->sparse = true;
+        svi->pos = 0;
+        svi->sv = (uint8_t *)varint_read(sv + sizeof(sv_counter_t), &svi->num_left);
+        sparse_next_item(svi);
+    }
+}
+
+static state_t *sparse_iterate_next(statevec_iterator_t *svi, bool *is_end)
+{
+    if (svi->num_left == 0) {
+        *is_end = true;
+        return NULL;
+    }
+
+    *is_end = false;
+    if (svi->pos < svi->next_index) {
+        svi->pos++;
+        return NULL;
+    }
+
+    state_t *res = (state_t *)svi->sv;
+    svi->sv += sizeof(state_t);
+    svi->pos++;
+    svi->num_left--;
+    sparse_next_item(svi);
+    return res;
+}
+
+static state_t *sparse_iterate_next_edge(statevec_iterator_t *svi, int *num_states)
+{
+    if (svi->num_left == 0) {
+        *num_states = -1;
+        return NULL;
+    }
+
+    if (svi->pos < svi->next_index) {
+        *num_states = svi->next_index - svi->pos;
+        svi->pos = svi->next_index;
+        return NULL;
+    }
+
+    /* run of adjacent identical states */
+    state_t *res = (state_t *)svi->sv;
+    *num_states = 0;
+    do {
+        svi->sv += sizeof(state_t);
+        svi->pos++;
+        svi->num_left--;
+        (*num_states)++;
+        sparse_next_item(svi);
+    } while (svi->num_left &&
+             svi->next_index == svi->pos &&
+             *num_states < INT_MAX &&
+             match_same_state((state_t *)svi->sv, res));
+
+    return res;
 }
 
 /*
@@ -71,6 +202,9 @@ void sv_iterate_start(statevec_t *sv, statevec_iterator_t *svi)
  */
 state_t *sv_iterate_next(statevec_iterator_t *svi, bool* is_end)
 {
+    if (svi->sparse)
+        return sparse_iterate_next(svi, is_end);
+
     if (svi->sv == NULL) {
         *is_end = true;
         return NULL;
@@ -105,6 +239,9 @@ state_t *sv_iterate_next(statevec_iterator_t *svi, bool* is_end)
 
 state_t *sv_iterate_next_edge(statevec_iterator_t *svi, int *num_states)
 {
+    if (svi->sparse)
+        return sparse_iterate_next_edge(svi, num_states);
+
     if (svi->sv == NULL) {
         *num_states = -1;
         return NULL;
@@ -181,18 +318,26 @@ void sv_free(statevec_t *sv) {
     free(sv);
 }
 
+/*
+ * Constructor buffers start small and grow on demand, so that huge foreach
+ * cardinalities don't cost max_size_bytes per thread up front.
+ */
+#define SV_INITIAL_CAPACITY 4096
+
 /* svc must be initialized to 0 when calling this for the first time */
 void sv_create(statevec_constructor_t *svc, int max_items)
 {
-    int max_size_bytes = max_items * (sizeof(state_t) + sizeof(sv_counter_t))
-                         + sizeof(sv_counter_t);
+    uint64_t max_size_bytes = (uint64_t)max_items * (sizeof(state_t) + sizeof(sv_counter_t))
+                              + sizeof(sv_counter_t);
 
     if (svc->max_size_bytes > 0) {
         CHECK(svc->max_size_bytes == max_size_bytes,
               "sv_create: bad max_size\n");
     } else {
         svc->max_size_bytes = max_size_bytes;
-        svc->buf = malloc(max_size_bytes);
+        svc->capacity = MIN(max_size_bytes, SV_INITIAL_CAPACITY);
+        svc->buf = malloc(svc->capacity);
+        CHECK(svc->buf, "could not allocate state vector buffer");
     }
 
     svc->plast_counter = NULL;
@@ -204,6 +349,33 @@ void sv_create(statevec_constructor_t *svc, int max_items)
 void sv_free_constructor(statevec_constructor_t *svc)
 {
     free(svc->buf);
+    free(svc->sparse_buf);
+}
+
+/* Make sure there is room for size bytes plus the terminator */
+static void sv_reserve(statevec_constructor_t *svc, uint64_t size)
+{
+    size += sizeof(sv_counter_t);
+    CHECK(size <= svc->max_size_bytes, "sv overflow");
+
+    if (size <= svc->capacity)
+        return;
+
+    uint64_t capacity = svc->capacity;
+    while (capacity < size)
+        capacity *= 2;
+    capacity = MIN(capacity, svc->max_size_bytes);
+
+    uint8_t *buf = realloc(svc->buf, capacity);
+    CHECK(buf, "could not grow state vector buffer to %" PRIu64 " bytes", capacity);
+
+    if (svc->plast_counter)
+        svc->plast_counter = (sv_counter_t *)(buf + ((uint8_t *)svc->plast_counter - svc->buf));
+    if (svc->plast_state)
+        svc->plast_state = (state_t *)(buf + ((uint8_t *)svc->plast_state - svc->buf));
+
+    svc->buf = buf;
+    svc->capacity = capacity;
 }
 
 #define ST_PLUS_C (sizeof(state_t) + sizeof(sv_counter_t))
@@ -212,14 +384,15 @@ sv_counter_t *sv_append_item_internal(statevec_constructor_t *svc,
                                       state_t *pstate)
 {
     if (!match_is_initial_state(pstate)) {
+        sv_reserve(svc, svc->size + ST_PLUS_C);
         svc->size += ST_PLUS_C;
-        CHECK(svc->size <= svc->max_size_bytes, "sv overflow");
         sv_counter_t *pcounter = (sv_counter_t *)&svc->buf[svc->size - ST_PLUS_C];
         state_t *plast_state = (state_t *)&svc->buf[svc->size - sizeof(state_t)];
         *pcounter = make_counter(1, false);
         memcpy(plast_state, pstate, sizeof(state_t));
         return pcounter;
     } else {
+        sv_reserve(svc, svc->size + sizeof(sv_counter_t));
         svc->size += sizeof(sv_counter_t);
         sv_counter_t *pcounter = (sv_counter_t *)&svc->buf[svc->size - sizeof(sv_counter_t)];
         *pcounter = make_counter(1, true);
@@ -259,38 +432,278 @@ void sv_append(statevec_constructor_t *svc, state_t *pstate, int num_states)
         svc->plast_state = (state_t *)&svc->buf[svc->size - sizeof(state_t)];
 }
 
-statevec_t *sv_finish(statevec_constructor_t *svc, uint64_t *out_size_bytes)
+/*
+ * Terminate the vector in the constructor buffer and return its size
+ * including the terminator, or 0 if the vector only contains initial states.
+ */
+static uint64_t sv_terminate(statevec_constructor_t *svc)
 {
     /* if all we have is initial states, return NULL */
-    sv_counter_t *pfirst_counter = (sv_counter_t *)&svc->buf;
+    sv_counter_t *pfirst_counter = (sv_counter_t *)svc->buf;
 
     if (svc->size == 0)
-        return NULL;
+        return 0;
 
     if ((is_empty_state_counter(*pfirst_counter)) &&
         (svc->size == sizeof(sv_counter_t)))
     {
-        return NULL;
+        return 0;
     }
 
 
-    int total_bytes = -1;
+    uint64_t total_bytes = 0;
     if (svc->plast_state == NULL) {
         total_bytes = svc->size - sizeof(sv_counter_t);
     } else {
         total_bytes = svc->size;
     }
 
+    /* sv_reserve always leaves room for the terminator */
+    sv_counter_t terminator = 0;
+    memcpy(&svc->buf[total_bytes], &terminator, sizeof(sv_counter_t));
+    return total_bytes + sizeof(sv_counter_t);
+}
+
+/*
+ * Finish the vector and return it in the smaller of the two encodings.
+ * Returns 0 if the vector only contains initial states.
+ */
+static uint64_t sv_encode(statevec_constructor_t *svc, const uint8_t **out)
+{
+    uint64_t rle_size = sv_terminate(svc);
+    *out = svc->buf;
+    if (rle_size == 0)
+        return 0;
+
+    /* compute sparse size from the RLE encoding */
+    uint64_t num_items = 0;
+    uint64_t pos = 0;
+    uint64_t next = 0;
+    uint64_t sparse_size = 0;
+    const uint8_t *p = svc->buf;
+    while (1) {
+        sv_counter_t c;
+        memcpy(&c, p, sizeof(sv_counter_t));
+        p += sizeof(sv_counter_t);
+        if (c == 0)
+            break;
+        if (is_empty_state_counter(c)) {
+            pos += counter_get_count(c);
+        } else {
+            for (int i = 0; i < counter_get_count(c); i++) {
+                sparse_size += varint_size(pos - next) + sizeof(state_t);
+                next = ++pos;
+                num_items++;
+            }
+            p += sizeof(state_t);
+        }
+        if (sparse_size >= rle_size)
+            return rle_size;
+    }
+    sparse_size += sizeof(sv_counter_t) + varint_size(num_items);
+    if (sparse_size >= rle_size)
+        return rle_size;
+
+    if (svc->sparse_capacity < sparse_size) {
+        free(svc->sparse_buf);
+        svc->sparse_capacity = MAX(sparse_size, SV_INITIAL_CAPACITY);
+        svc->sparse_buf = malloc(svc->sparse_capacity);
+        CHECK(svc->sparse_buf, "could not allocate sparse state vector buffer");
+    }
+
+    uint8_t *w = svc->sparse_buf;
+    sv_counter_t tag = 0;
+    memcpy(w, &tag, sizeof(sv_counter_t));
+    w = varint_write(w + sizeof(sv_counter_t), num_items);
+
+    pos = next = 0;
+    p = svc->buf;
+    while (1) {
+        sv_counter_t c;
+        memcpy(&c, p, sizeof(sv_counter_t));
+        p += sizeof(sv_counter_t);
+        if (c == 0)
+            break;
+        if (is_empty_state_counter(c)) {
+            pos += counter_get_count(c);
+        } else {
+            for (int i = 0; i < counter_get_count(c); i++) {
+                w = varint_write(w, pos - next);
+                memcpy(w, p, sizeof(state_t));
+                w += sizeof(state_t);
+                next = ++pos;
+            }
+            p += sizeof(state_t);
+        }
+    }
+
+    *out = svc->sparse_buf;
+    return w - svc->sparse_buf;
+}
+
+statevec_t *sv_finish(statevec_constructor_t *svc, uint64_t *out_size_bytes,
+                      arena_t *arena)
+{
+    const uint8_t *buf;
+    uint64_t size = sv_encode(svc, &buf);
+    if (size == 0)
+        return NULL;
+
     if (out_size_bytes)
-        *out_size_bytes = total_bytes + sizeof(sv_counter_t);
+        *out_size_bytes = size;
 
-    statevec_t *res = malloc(total_bytes + sizeof(sv_counter_t));
-    memcpy(res, svc->buf, total_bytes);
-    sv_counter_t *terminator = (sv_counter_t*)&res[total_bytes];
-    *terminator = 0;
+    statevec_t *res = arena ? arena_alloc(arena, size) : malloc(size);
+    memcpy(res, buf, size);
     return res;
 }
 
+uint64_t sv_size(const statevec_t *sv)
+{
+    if (is_sparse(sv)) {
+        uint64_t num_items;
+        const uint8_t *p = varint_read(sv + sizeof(sv_counter_t), &num_items);
+        for (uint64_t i = 0; i < num_items; i++) {
+            uint64_t gap;
+            p = varint_read(p, &gap) + sizeof(state_t);
+        }
+        return p - sv;
+    }
+
+    uint64_t size = 0;
+    while (1) {
+        sv_counter_t c;
+        memcpy(&c, &sv[size], sizeof(sv_counter_t));
+        size += sizeof(sv_counter_t);
+        if (c == 0)
+            return size;
+        if (!is_empty_state_counter(c))
+            size += sizeof(state_t);
+    }
+}
+
+statevec_t *sv_copy(const statevec_t *sv, arena_t *arena, uint64_t *out_size_bytes)
+{
+    if (sv == NULL)
+        return NULL;
+
+    uint64_t size = sv_size(sv);
+
+    if (out_size_bytes)
+        *out_size_bytes = size;
+
+    statevec_t *res = arena ? arena_alloc(arena, size) : malloc(size);
+    memcpy(res, sv, size);
+    return res;
+}
+
+/*
+ * Intern table is split into shards by hash of the vector, each shard is a
+ * JudyL array (XXH64 of vector bytes -> interned vector) protected by its own
+ * lock. Vector bytes are only stored in the arena. Colliding vectors go to
+ * the next free key (hash + 1, hash + 2, ...), which works as nothing is ever
+ * removed from the table.
+ */
+#define NUM_INTERN_SHARDS 64
+
+typedef struct sv_intern_shard_t {
+    Pvoid_t vectors;
+#ifdef _OPENMP
+    omp_lock_t lock;
+#endif
+} sv_intern_shard_t;
+
+struct sv_intern_table_t {
+    sv_intern_shard_t shards[NUM_INTERN_SHARDS];
+};
+
+sv_intern_table_t *sv_intern_create()
+{
+    sv_intern_table_t *table = calloc(1, sizeof(sv_intern_table_t));
+    CHECK(table, "could not allocate intern table");
+#ifdef _OPENMP
+    for (int i = 0; i < NUM_INTERN_SHARDS; i++)
+        omp_init_lock(&table->shards[i].lock);
+#endif
+    return table;
+}
+
+void sv_intern_free(sv_intern_table_t *table)
+{
+    for (int i = 0; i < NUM_INTERN_SHARDS; i++) {
+        Word_t freed;
+        JLFA(freed, table->shards[i].vectors);
+#ifdef _OPENMP
+        omp_destroy_lock(&table->shards[i].lock);
+#endif
+    }
+    free(table);
+}
+
+static statevec_t *sv_intern_bytes(sv_intern_table_t *table,
+                                   const uint8_t *buf, uint64_t size,
+                                   arena_t *arena, uint64_t *out_size_bytes)
+{
+    Word_t key = XXH64(buf, size, 0);
+    sv_intern_shard_t *shard = &table->shards[key % NUM_INTERN_SHARDS];
+
+#ifdef _OPENMP
+    omp_set_lock(&shard->lock);
+#endif
+    PWord_t pv;
+    while (1) {
+        JLI(pv, shard->vectors, key);
+        CHECK(pv, "could not insert into intern table");
+
+        const statevec_t *sv = *(const statevec_t **)pv;
+        if (sv == NULL || (sv_size(sv) == size && memcmp(sv, buf, size) == 0))
+            break;
+        key++;
+    }
+
+    uint64_t new_bytes = 0;
+    if (*pv == 0) {
+        statevec_t *res = arena ? arena_alloc(arena, size) : malloc(size);
+        memcpy(res, buf, size);
+        *(statevec_t **)pv = res;
+        new_bytes = size;
+    }
+    statevec_t *res = *(statevec_t **)pv;
+#ifdef _OPENMP
+    omp_unset_lock(&shard->lock);
+#endif
+
+    if (out_size_bytes)
+        *out_size_bytes = new_bytes;
+    return res;
+}
+
+statevec_t *sv_intern(sv_intern_table_t *table, const statevec_t *sv,
+                      arena_t *arena, uint64_t *out_size_bytes)
+{
+    if (sv == NULL) {
+        if (out_size_bytes)
+            *out_size_bytes = 0;
+        return NULL;
+    }
+    return sv_intern_bytes(table, sv, sv_size(sv), arena, out_size_bytes);
+}
+
+statevec_t *sv_finish_interned(statevec_constructor_t *svc,
+                               sv_intern_table_t *table,
+                               arena_t *arena,
+                               uint64_t *out_size_bytes)
+{
+    if (out_size_bytes)
+        *out_size_bytes = 0;
+
+    const uint8_t *buf;
+    uint64_t size = sv_encode(svc, &buf);
+    if (size == 0)
+        return NULL;
+
+    return sv_intern_bytes(table, buf, size, arena, out_size_bytes);
+}
+
 void test1() {
     state_t states[4];
     fprintf(stderr, "test1\n");
@@ -304,7 +717,7 @@ void test1() {
     for (int i = 0; i < sizeof(states) / sizeof(state_t); i++)
         sv_append(&svc, &states[i], 1);
 
-    statevec_t *sv = sv_finish(&svc, NULL);
+    statevec_t *sv = sv_finish(&svc, NULL, NULL);
     CHECK(sv == NULL, "sv == NULL");
 }
 
@@ -323,7 +736,7 @@ void test2() {
     for (int i = 0; i < sizeof(states) / sizeof(state_t); i++)
         sv_append(&svc, &states[i], 1);
 
-    statevec_t *sv = sv_finish(&svc, NULL);
+    statevec_t *sv = sv_finish(&svc, NULL, NULL);
     CHECK(sv != NULL, "sv!=NULL");
 
     statevec_iterator_t svi;
@@ -359,7 +772,7 @@ void test3() {
     for (int i = 0; i < sizeof(states) / sizeof(state_t); i++)
         sv_append(&svc, &states[i], 1);
 
-    statevec_t *sv = sv_finish(&svc, NULL);
+    statevec_t *sv = sv_finish(&svc, NULL, NULL);
     CHECK(sv != NULL, "sv!=NULL");
 
     statevec_iterator_t svi;
@@ -386,9 +799,163 @@ void test3() {
     }
 }
 
+void test4() {
+    state_t states[10];
+    fprintf(stderr, "test4\n");
+
+    for (int i = 0; i < sizeof(states) / sizeof(state_t); i++) {
+        match_trail_init(&states[i]);
+        states[i].ri = i % 3;
+    }
+
+    statevec_constructor_t svc = {0};
+    sv_create(&svc, sizeof(states)/sizeof(state_t));
+
+    for (int i = 0; i < sizeof(states) / sizeof(state_t); i++)
+        sv_append(&svc, &states[i], 1);
+
+    arena_t *arena1 = arena_create(1);
+    arena_t *arena2 = arena_create(2);
+
+    uint64_t size, copy_size;
+    statevec_t *sv = sv_finish(&svc, &size, arena1);
+    CHECK(sv != NULL, "sv!=NULL");
+    CHECK(arena_generation_of(sv) == 1, "generation %u", arena_generation_of(sv));
+
+    statevec_t *copy = sv_copy(sv, arena2, &copy_size);
+    CHECK(arena_generation_of(copy) == 2, "generation %u", arena_generation_of(copy));
+    CHECK(copy_size == size, "copy size %lu /= %lu", copy_size, size);
+    CHECK(memcmp(sv, copy, size) == 0, "copy differs");
+
+    arena_destroy(arena1);
+
+    statevec_iterator_t svi;
+    sv_iterate_start(copy, &svi);
+    int n = 0;
+    while(1) {
+        bool is_end = false;
+        state_t *s = sv_iterate_next(&svi, &is_end);
+        if (is_end)
+            break;
+        CHECK(s->ri == states[n].ri, "s->ri == %d /= %d", s->ri, states[n].ri);
+        n++;
+    }
+    CHECK(n==sizeof(states)/sizeof(state_t), "n=%d", n);
+
+    arena_destroy(arena2);
+    sv_free_constructor(&svc);
+}
+
+void test5() {
+    state_t states[10];
+    fprintf(stderr, "test5\n");
+
+    for (int i = 0; i < sizeof(states) / sizeof(state_t); i++) {
+        match_trail_init(&states[i]);
+        states[i].ri = i % 3;
+    }
+
+    arena_t *arena = arena_create(1);
+    sv_intern_table_t *table = sv_intern_create();
+
+    statevec_constructor_t svc = {0};
+    statevec_t *svs[3];
+    uint64_t sizes[3];
+    for (int k = 0; k < 3; k++) {
+        sv_create(&svc, sizeof(states)/sizeof(state_t));
+        /* third vector differs from the first two */
+        if (k == 2)
+            states[5].ri = 7;
+        for (int i = 0; i < sizeof(states) / sizeof(state_t); i++)
+            sv_append(&svc, &states[i], 1);
+        svs[k] = sv_finish_interned(&svc, table, arena, &sizes[k]);
+        CHECK(svs[k] != NULL, "sv!=NULL");
+    }
+
+    CHECK(svs[0] == svs[1], "identical vectors not shared");
+    CHECK(sizes[0] > 0 && sizes[1] == 0, "sizes %lu %lu", sizes[0], sizes[1]);
+    CHECK(svs[2] != svs[0], "different vectors shared");
+    CHECK(sizes[2] == sv_size(svs[2]), "size %lu", sizes[2]);
+
+    uint64_t size;
+    CHECK(sv_intern(table, svs[2], arena, &size) == svs[2], "interning is not idempotent");
+    CHECK(size == 0, "size %lu", size);
+
+    sv_intern_free(table);
+    arena_destroy(arena);
+    sv_free_constructor(&svc);
+}
+
+void test6() {
+    const int num_states = 100000;
+    fprintf(stderr, "test6\n");
+
+    state_t empty, a, b;
+    match_trail_init(&empty);
+    match_trail_init(&a);
+    match_trail_init(&b);
+    a.ri = 1;
+    b.ri = 2;
+
+    /* a few scattered states, including a run of two identical ones */
+    int indices[] = {3, 40000, 40001, 70000, 99998};
+    state_t *values[] = {&a, &b, &b, &a, &b};
+    int num_indices = sizeof(indices) / sizeof(int);
+
+    statevec_constructor_t svc = {0};
+    sv_create(&svc, num_states);
+
+    int prev = 0;
+    for (int k = 0; k < num_indices; k++) {
+        if (indices[k] > prev)
+            sv_append(&svc, &empty, indices[k] - prev);
+        sv_append(&svc, values[k], 1);
+        prev = indices[k] + 1;
+    }
+    sv_append(&svc, &empty, num_states - prev);
+
+    uint64_t size;
+    statevec_t *sv = sv_finish(&svc, &size, NULL);
+    CHECK(sv != NULL, "sv!=NULL");
+    CHECK(sv_size(sv) == size, "size %lu /= %lu", sv_size(sv), size);
+    CHECK(size < num_indices * (sizeof(state_t) + 4) + 8, "not sparse: %lu bytes", size);
+
+    statevec_iterator_t svi;
+    sv_iterate_start(sv, &svi);
+    int n = 0, k = 0;
+    while(1) {
+        bool is_end = false;
+        state_t *s = sv_iterate_next(&svi, &is_end);
+        if (is_end)
+            break;
+        if (k < num_indices && n == indices[k]) {
+            CHECK(s && s->ri == values[k]->ri, "state at %d", n);
+            k++;
+        } else {
+            CHECK(s == NULL, "state at %d should be empty", n);
+        }
+        n++;
+    }
+    CHECK(k == num_indices, "k=%d", k);
+
+    int edges[] = {3, 1, 40000 - 4, 2, 70000 - 40002, 1, 99998 - 70001, 1, -1};
+    sv_iterate_start(sv, &svi);
+    for (int i = 0; i < sizeof(edges) / sizeof(int); i++) {
+        int num;
+        sv_iterate_next_edge(&svi, &num);
+        CHECK(num == edges[i], "edge %d: %d /= %d", i, num, edges[i]);
+    }
+
+    sv_free(sv);
+    sv_free_constructor(&svc);
+}
+
 void run_tests() {
     test1();
     test2();
     test3();
+    test4();
+    test5();
+    test6();
     fprintf(stderr, "tests done\n");
 }
@@ -2,6 +2,7 @@
 
 #include "fns_generated.h"
 #include "out_traildb.h"
+#include "arena.h"
 
 /*
  * A compressed vector of matcher states (state_t structures).
@@ -22,6 +23,12 @@ typedef uint8_t statevec_t;
 typedef struct statevec_iterator_t {
     uint8_t *sv;
     int i;
+
+    /* sparse encoding only */
+    bool sparse;
+    uint64_t pos;
+    uint64_t next_index;
+    uint64_t num_left;
 } statevec_iterator_t;
 
 /************************ iterating over vectors *****************************/
@@ -41,15 +48,26 @@ state_t *sv_iterate_next(statevec_iterator_t *svi, bool *is_end);
  */
 state_t *sv_iterate_next_edge(statevec_iterator_t *svi, int *num_states);
 
-/* Free vector. */
+/* Free vector. Only for vectors allocated without an arena. */
 void sv_free(statevec_t *sv);
 
+/*
+ * Copy vector into arena (or malloc'd memory if arena is NULL). If
+ * out_size_bytes is not NULL, it will contain the size of the copy.
+ */
+statevec_t *sv_copy(const statevec_t *sv, arena_t *arena, uint64_t *out_size_bytes);
+
 typedef struct statevec_constructor_t {
     uint8_t *buf;
-    int size;
-    int max_size_bytes;
+    uint64_t size;
+    uint64_t capacity;
+    uint64_t max_size_bytes;
     sv_counter_t *plast_counter;
     state_t *plast_state;
+
+    /* scratch space for the sparse encoding */
+    uint8_t *sparse_buf;
+    uint64_t sparse_capacity;
 } statevec_constructor_t;
 
 /************************ constructing vectors *******************************/
@@ -68,7 +86,53 @@ void sv_free_constructor(statevec_constructor_t *svc);
 /* Append multiple duplicate states */
 void sv_append(statevec_constructor_t *svc, state_t *pstate, int num_states);
 
-/* Finish constructing a vector. */
-statevec_t *sv_finish(statevec_constructor_t *svc, uint64_t *out_size_bytes);
+/*
+ * Finish constructing a vector, using RLE or sparse encoding, whichever is
+ * smaller. The vector is allocated from arena, or with malloc if arena is
+ * NULL.
+ */
+statevec_t *sv_finish(statevec_constructor_t *svc, uint64_t *out_size_bytes,
+                      arena_t *arena);
+
+/*
+ * Return the size of the encoded vector in bytes, including the terminator.
+ */
+uint64_t sv_size(const statevec_t *sv);
+
+/************************ interning vectors **********************************/
+
+/*
+ * Many cookies end up with byte-identical vectors, for example "state 1 for
+ * tuple 17, initial everywhere else". An intern table makes sure each
+ * distinct vector is stored only once per arena generation, so that state
+ * maps can share pointers to it.
+ *
+ * There are no reference counts: an interned vector lives as long as the
+ * arena it was allocated from. The table can be used by multiple threads
+ * concurrently, each allocating from its own arena, as long as all these
+ * arenas belong to the same generation.
+ */
+typedef struct sv_intern_table_t sv_intern_table_t;
+
+sv_intern_table_t *sv_intern_create();
+
+void sv_intern_free(sv_intern_table_t *table);
+
+/*
+ * Return the interned copy of sv, copying it into arena if it's not in the
+ * table yet. If out_size_bytes is not NULL, it will contain the number of
+ * bytes newly allocated (zero if the vector was already there).
+ */
+statevec_t *sv_intern(sv_intern_table_t *table, const statevec_t *sv,
+                      arena_t *arena, uint64_t *out_size_bytes);
+
+/*
+ * Same as sv_finish, but return an interned vector. Does not allocate if an
+ * identical vector has been interned before.
+ */
+statevec_t *sv_finish_interned(statevec_constructor_t *svc,
+                               sv_intern_table_t *table,
+                               arena_t *arena,
+                               uint64_t *out_size_bytes);
 
 void sv_dump(statevec_t *sv);
\ No newline at end of file
@@ -2,12 +2,19 @@ from __future__ import print_function
 import traildb
 import sys
 import json
+import argparse
 
 if __name__ == '__main__':
-    tdb_paths = sys.argv[1:]
+    parser = argparse.ArgumentParser()
+    parser.add_argument("tdb_paths", metavar="TDB", nargs="+")
+    parser.add_argument("--cookies", type=int, default=100000, help="number of cookies in every traildb")
+    parser.add_argument("--first-cookie", type=int, default=0, help="number of the first cookie, so that different runs can generate different cookies")
+    args = parser.parse_args()
+
+    tdb_paths = args.tdb_paths
 
     ofields = ['advertisable_eid', 'segment_eid']
-    ncookies = 100000
+    ncookies = args.cookies
 
     nevents = 200
 
@@ -18,7 +25,7 @@ if __name__ == '__main__':
 
         print("generating %s" % tdb_path, file=sys.stderr)
 
-        for i in range(ncookies):
+        for i in range(args.first_cookie, args.first_cookie + ncookies):
             base_ts = 1000000 + 100000 * ndb
 
             cookie_hex = str(i).encode('hex').ljust(32, '0')
@@ -32,7 +39,7 @@ if __name__ == '__main__':
                 res[adv_eid] = res.get(adv_eid, 0) + 1
 
             if i % 1000 == 0:
-                print("%d%%" % (i * 100 / ncookies), file=sys.stderr, end="\r")
+                print("%d%%" % ((i - args.first_cookie) * 100 / ncookies), file=sys.stderr, end="\r")
 
         print("100%", file=sys.stderr, end="\r")
         t.finalize()
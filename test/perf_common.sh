@@ -0,0 +1,30 @@
+#
+# Shared setup of the perf scripts: generates the perftest traildbs if they
+# aren't there yet and times matchers over them. Source from test/.
+#
+
+export PATH=../bin:$PATH
+
+TDBS="/tmp/tdbperftest1 /tmp/tdbperftest2"
+
+if [ ! -e /tmp/tdbperftest1.tdb ] || [ ! -e /tmp/tdbperftest2.tdb ]; then
+    echo "Generating test traildbs... That may take a while"
+    python perf/perftest1_db.py $TDBS >/dev/null
+fi
+
+NUM_EVENTS=$(python -c "import sys, traildb; print(sum(traildb.TrailDB(p).num_events for p in sys.argv[1:]))" $TDBS)
+
+# time_matcher LABEL MATCHER OUTPUT
+#
+# Runs MATCHER over $TDBS, writing results to OUTPUT, and prints the wall
+# time and time per event.
+time_matcher() {
+    local label=$1
+    local matcher=$2
+    local output=$3
+
+    local start=$(date +%s.%N)
+    $matcher $TDBS >$output
+    local end=$(date +%s.%N)
+    python -c "print('%-28s %.2fs %.1f ns/event' % ('$label', $end - $start, ($end - $start) * 1e9 / $NUM_EVENTS))"
+}
@@ -0,0 +1,27 @@
+#!/bin/bash
+set -e -o pipefail
+
+# Speedup from profile-guided and link-time optimization (trck --pgo). The
+# profile is collected on a smaller traildb of different cookies, so that
+# matchers aren't timed on the same data they were trained on.
+
+. ./perf_common.sh
+
+SAMPLE_TDB=/tmp/tdbperfsample
+
+if [ ! -e $SAMPLE_TDB.tdb ]; then
+    python perf/perftest1_db.py --cookies 10000 --first-cookie 100000 $SAMPLE_TDB >/dev/null
+fi
+
+export OMP_NUM_THREADS=1
+
+for SOURCE in perf/perftest1.tr perf/perftest2.tr; do
+    trck -c $SOURCE -o /tmp/matcher-o3
+    trck -c --pgo $SAMPLE_TDB $SOURCE -o /tmp/matcher-pgo
+
+    for VARIANT in o3 pgo; do
+        time_matcher "$SOURCE $VARIANT" /tmp/matcher-$VARIANT /tmp/res-$VARIANT.json
+    done
+
+    ./ddiff.py /tmp/res-o3.json /tmp/res-pgo.json
+done
@@ -0,0 +1,20 @@
+#!/bin/bash
+set -e -o pipefail
+
+# Per-event cost of a simple counting program, compiled with and without
+# the window-free, foreach-free match_trail specialization.
+
+. ./perf_common.sh
+
+SOURCE=perf/perftest2.tr
+
+trck -c $SOURCE -o /tmp/matcher-specialized
+trck -c --no-specialize $SOURCE -o /tmp/matcher-general
+
+export OMP_NUM_THREADS=1
+
+for VARIANT in general specialized; do
+    time_matcher $VARIANT /tmp/matcher-$VARIANT /tmp/res-$VARIANT.json
+done
+
+./ddiff.py /tmp/res-general.json /tmp/res-specialized.json
@@ -0,0 +1,126 @@
+#!/bin/bash
+set -e -o pipefail
+
+#
+# Splits one run over two TrailDBs into runs that carry states between them
+# (--state-file, --checkpoint/--resume, --save-state/--load-state) and checks
+# that they give the same results as a single uninterrupted run.
+#
+
+export PATH=../bin:$PATH
+export LD_LIBRARY_PATH=../deps/traildb/.libs
+export PYTHONPATH=../deps/traildb-python/
+
+TMP_PATH=/tmp/testpersist
+rm -rf $TMP_PATH 2>/dev/null || true
+mkdir -p $TMP_PATH
+
+BIN=$TMP_PATH/matcher-traildb
+
+cat >$TMP_PATH/persist.tr <<END
+foreach %aeid in @arr
+    start ->
+        receive
+            type = "imp", advertisable_eid = %aeid -> yield type to #types, clicked
+            * -> repeat
+    clicked ->
+        receive
+            type = "cli", advertisable_eid = %aeid -> yield \$match, yield cookie to ^trails, quit
+            * -> repeat
+        after 1000s -> yield \$expired, quit
+END
+
+echo '{"@arr" : [["a1"], ["a2"]]}' >$TMP_PATH/params.json
+echo '{"@arr" : [["a1"], ["a3"]]}' >$TMP_PATH/other_params.json
+
+json2tdb $TMP_PATH/tdb1 <<END
+{
+    "c1" : [
+        {"type" : "imp", "advertisable_eid" : "a1", "timestamp" : 100}
+    ],
+    "c2" : [
+        {"type" : "imp", "advertisable_eid" : "a2", "timestamp" : 100},
+        {"type" : "cli", "advertisable_eid" : "a2", "timestamp" : 150}
+    ],
+    "c3" : [
+        {"type" : "imp", "advertisable_eid" : "a1", "timestamp" : 100}
+    ],
+    "c4" : [
+        {"type" : "imp", "advertisable_eid" : "a2", "timestamp" : 120}
+    ]
+}
+END
+
+json2tdb $TMP_PATH/tdb2 <<END
+{
+    "c1" : [
+        {"type" : "cli", "advertisable_eid" : "a1", "timestamp" : 300}
+    ],
+    "c4" : [
+        {"type" : "cli", "advertisable_eid" : "a2", "timestamp" : 1500}
+    ],
+    "c5" : [
+        {"type" : "imp", "advertisable_eid" : "a1", "timestamp" : 400},
+        {"type" : "cli", "advertisable_eid" : "a1", "timestamp" : 500}
+    ]
+}
+END
+
+trck -c $TMP_PATH/persist.tr -o $BIN
+
+run() {
+    $BIN --params $TMP_PATH/params.json "$@" 2>$TMP_PATH/stderr.log
+}
+
+FAILED=0
+
+check() {
+    local desc=$1
+    local result=$2
+
+    if ./ddiff.py $TMP_PATH/full.json $result && ./ddiff.py $result $TMP_PATH/full.json ; then
+        echo "SUCCEEDED $desc"
+    else
+        echo "FAILED $desc, output: $(cat $result)"
+        FAILED=$((FAILED+1))
+    fi
+}
+
+run $TMP_PATH/tdb1 $TMP_PATH/tdb2 >$TMP_PATH/full.json
+
+run --state-file $TMP_PATH/states $TMP_PATH/tdb1 $TMP_PATH/tdb2 >$TMP_PATH/state_file.json
+check "state file" $TMP_PATH/state_file.json
+
+# first run stops after tdb1, resumed run skips it
+run --checkpoint $TMP_PATH/checkpoint $TMP_PATH/tdb1 >/dev/null
+run --checkpoint $TMP_PATH/checkpoint --resume $TMP_PATH/tdb1 $TMP_PATH/tdb2 >$TMP_PATH/resume.json
+check "checkpoint and resume" $TMP_PATH/resume.json
+
+run --state-file $TMP_PATH/resume_states --checkpoint $TMP_PATH/checkpoint_sf $TMP_PATH/tdb1 >/dev/null
+run --state-file $TMP_PATH/resume_states --checkpoint $TMP_PATH/checkpoint_sf --resume \
+    $TMP_PATH/tdb1 $TMP_PATH/tdb2 >$TMP_PATH/resume_state_file.json
+check "checkpoint and resume with a state file" $TMP_PATH/resume_state_file.json
+
+run --save-state $TMP_PATH/saved $TMP_PATH/tdb1 >/dev/null
+run --load-state $TMP_PATH/saved $TMP_PATH/tdb2 >$TMP_PATH/load.json
+check "save and load states" $TMP_PATH/load.json
+
+# checkpoint from the same program with different foreach values
+set +e
+$BIN --params $TMP_PATH/other_params.json --checkpoint $TMP_PATH/checkpoint --resume \
+     $TMP_PATH/tdb1 $TMP_PATH/tdb2 >/dev/null 2>$TMP_PATH/stderr.log
+ERRCODE=$?
+set -e
+if [ $ERRCODE -ne 0 ] && grep -q "different foreach values" $TMP_PATH/stderr.log ; then
+    echo "SUCCEEDED rejecting checkpoint with different foreach values"
+else
+    echo "FAILED rejecting checkpoint with different foreach values"
+    FAILED=$((FAILED+1))
+fi
+
+if [ $FAILED -eq 0 ] ; then
+    echo "SUCCEDED"
+else
+    echo "FAILED $FAILED"
+    exit 1
+fi